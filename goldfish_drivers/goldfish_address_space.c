@@ -16,8 +16,10 @@
 #include <linux/pci_ids.h>
 #include <linux/pci.h>
 #include <linux/page_size_compat.h>
+#include <linux/kref.h>
 
 #include <goldfish/goldfish_address_space.h>
+#include "goldfish_address_space.h"
 
 MODULE_DESCRIPTION("A Goldfish driver that allocates address space ranges in "
 		   "the guest to populate them later in the host. This allows "
@@ -83,6 +85,11 @@ struct as_device_state {
 	unsigned long		address_area_phys_address;
 
 	struct mutex		registers_lock;	/* protects registers */
+
+	/* the device and the mappings stay around while in-kernel users
+	 * hold blocks */
+	struct kref		kref;
+	bool			removed; /* protected by as_kernel_lock */
 };
 
 struct as_block {
@@ -118,6 +125,10 @@ struct as_file_state {
 	u32 handle; /* handle generated by the host */
 };
 
+/* the device handed to in-kernel users, protected by as_kernel_lock */
+static struct as_device_state *as_kernel_state;
+static DEFINE_MUTEX(as_kernel_lock);
+
 static void __iomem *as_register_address(void __iomem *base,
 					 int offset)
 {
@@ -812,6 +823,62 @@ static long as_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return res;
 }
 
+/**
+ * goldfish_address_space_alloc_block - allocate host-shared memory
+ * @size: the number of bytes wanted
+ * @block: filled in with the block, on success
+ *
+ * The block is mapped into the kernel at @block->vaddr; the host knows it
+ * by @block->offset.
+ */
+int goldfish_address_space_alloc_block(u64 size,
+				       struct goldfish_address_space_block *block)
+{
+	struct as_device_state *state;
+	long res;
+
+	mutex_lock(&as_kernel_lock);
+	state = as_kernel_state;
+	if (!state) {
+		mutex_unlock(&as_kernel_lock);
+		return -ENODEV;
+	}
+
+	block->size = size;
+	mutex_lock(&state->registers_lock);
+	res = as_ioctl_allocate_block_locked_impl(state, &block->size,
+						  &block->offset);
+	mutex_unlock(&state->registers_lock);
+	if (!res) {
+		block->phys_addr =
+			state->address_area_phys_address + block->offset;
+		block->vaddr = (char *)state->address_area + block->offset;
+		block->state = state;
+		kref_get(&state->kref);
+	}
+
+	mutex_unlock(&as_kernel_lock);
+	return res;
+}
+EXPORT_SYMBOL_GPL(goldfish_address_space_alloc_block);
+
+static void as_device_state_release(struct kref *kref);
+
+void goldfish_address_space_free_block(
+	const struct goldfish_address_space_block *block)
+{
+	struct as_device_state *state = block->state;
+
+	mutex_lock(&as_kernel_lock);
+	/* the host dropped the blocks of a removed device already */
+	if (!state->removed)
+		as_ioctl_unallocate_block_impl(state, block->offset);
+	mutex_unlock(&as_kernel_lock);
+
+	kref_put(&state->kref, as_device_state_release);
+}
+EXPORT_SYMBOL_GPL(goldfish_address_space_free_block);
+
 static const struct file_operations userspace_file_operations = {
 	.owner = THIS_MODULE,
 	.open = as_open,
@@ -929,8 +996,14 @@ create_as_device(struct pci_dev *dev, const struct pci_device_id *id)
 			  AS_REGISTER_PHYS_START_HIGH,
 			  upper_32_bits(state->address_area_phys_address));
 
-	state->dev = dev;
+	state->dev = pci_dev_get(dev);
 	mutex_init(&state->registers_lock);
+	kref_init(&state->kref);
+
+	mutex_lock(&as_kernel_lock);
+	if (!as_kernel_state)
+		as_kernel_state = state;
+	mutex_unlock(&as_kernel_lock);
 
 	pci_set_drvdata(dev, state);
 	return 0;
@@ -949,16 +1022,33 @@ out_free_device_state:
 	return res;
 }
 
-static void as_pci_destroy_device(struct as_device_state *state)
+static void as_device_state_release(struct kref *kref)
 {
+	struct as_device_state *state =
+		container_of(kref, struct as_device_state, kref);
+
 	memunmap(state->address_area);
 	iounmap(state->io_registers);
-	misc_deregister(&state->miscdevice);
 	pci_release_region(state->dev, AS_PCI_AREA_BAR_ID);
 	pci_release_region(state->dev, AS_PCI_CONTROL_BAR_ID);
+	pci_dev_put(state->dev);
 	kfree(state);
 }
 
+static void as_pci_destroy_device(struct as_device_state *state)
+{
+	mutex_lock(&as_kernel_lock);
+	if (as_kernel_state == state)
+		as_kernel_state = NULL;
+	state->removed = true;
+	mutex_unlock(&as_kernel_lock);
+
+	misc_deregister(&state->miscdevice);
+	/* in-kernel users may still access their blocks, the area is only
+	 * unmapped once the last of them is freed */
+	kref_put(&state->kref, as_device_state_release);
+}
+
 static int __must_check
 as_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 {
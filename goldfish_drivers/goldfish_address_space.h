@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef GOLDFISH_ADDRESS_SPACE_H
+#define GOLDFISH_ADDRESS_SPACE_H
+
+#include <linux/types.h>
+
+struct as_device_state;
+
+/*
+ * In-kernel users of the address space: blocks of host-shared memory,
+ * mapped into the kernel.
+ */
+struct goldfish_address_space_block {
+	u64 offset;		/* into the address space, as the host sees it */
+	u64 size;
+	phys_addr_t phys_addr;
+	void *vaddr;
+	struct as_device_state *state;	/* private to the driver */
+};
+
+int goldfish_address_space_alloc_block(u64 size,
+				       struct goldfish_address_space_block *block);
+void goldfish_address_space_free_block(
+	const struct goldfish_address_space_block *block);
+
+#endif /* GOLDFISH_ADDRESS_SPACE_H */
@@ -40,6 +40,17 @@
  *    // after this, simply read() and write() to communicate with the
  *    // service. Exact protocol details left as an exercise to the reader.
  *
+ * Instead of the write(), the GOLDFISH_PIPE_IOC_CONNECT ioctl connects to
+ * "pipe:<service>" without pinning any user pages.
+ *
+ * Clients that issue many small writes can have the driver coalesce them
+ * with GOLDFISH_PIPE_IOC_SET_CORK, and streaming readers can have it read
+ * ahead with GOLDFISH_PIPE_IOC_SET_READAHEAD; those are the cases where
+ * data is copied through an intermediate buffer.
+ *
+ * splice() and sendfile() hand the host the page cache pages themselves,
+ * so e.g. a file transfer doesn't go through userspace at all.
+ *
  * This driver is very fast because it doesn't copy any data through
  * intermediate buffers, since the emulator is capable of translating
  * guest user addresses into host ones.
@@ -66,8 +77,12 @@
 #include <linux/spinlock.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+
+#include <goldfish/goldfish_pipe.h>
 
-static const char DEVICE_NAME[] = "goldfish_pipe_dprctd";
+static const char DEVICE_NAME[] = GOLDFISH_PIPE_DEVICE_NAME;
 
 /*
  * Update this when something changes in the driver's behavior so the host
@@ -231,6 +246,31 @@ struct goldfish_pipe {
 
 	/* A buffer of pages, too large to fit into a stack frame */
 	struct page *pages[MAX_BUFFERS_PER_COMMAND];
+
+	/*
+	 * Write coalescing, see GOLDFISH_PIPE_IOC_SET_CORK. wlock protects
+	 * the fields below and keeps the order of corked and direct writes.
+	 * The pending bytes are [wbuf + wbuf_off, wbuf + wbuf_off + wbuf_len).
+	 */
+	struct mutex wlock;
+	char *wbuf;
+	u32 wbuf_size;
+	u32 wbuf_off;
+	u32 wbuf_len;
+	unsigned long wbuf_delay;	/* in jiffies */
+	int wbuf_err;			/* of a flush nobody waited for */
+	struct delayed_work cork_work;
+
+	/*
+	 * Read-ahead, see GOLDFISH_PIPE_IOC_SET_READAHEAD. rlock protects
+	 * the fields below and serializes readers. The bytes read ahead are
+	 * [rbuf + rbuf_off, rbuf + rbuf_off + rbuf_len).
+	 */
+	struct mutex rlock;
+	char *rbuf;
+	u32 rbuf_size;
+	u32 rbuf_off;
+	u32 rbuf_len;
 };
 
 /* The global driver data. Holds a reference to the i/o page used to
@@ -318,42 +358,14 @@ static int goldfish_pipe_error_convert(int status)
 	}
 }
 
-static int goldfish_pin_user_pages(unsigned long first_page,
-				   unsigned long last_page,
-				   unsigned int last_page_size,
-				   int is_write,
-				   struct page *pages[MAX_BUFFERS_PER_COMMAND],
-				   unsigned int *iter_last_page_size)
-{
-	int ret;
-	int requested_pages = ((last_page - first_page) >> PAGE_SHIFT) + 1;
-
-	if (requested_pages > MAX_BUFFERS_PER_COMMAND) {
-		requested_pages = MAX_BUFFERS_PER_COMMAND;
-		*iter_last_page_size = PAGE_SIZE;
-	} else {
-		*iter_last_page_size = last_page_size;
-	}
-
-	ret = pin_user_pages_fast(first_page, requested_pages,
-				  (!is_write ? FOLL_WRITE : 0), pages);
-	if (ret <= 0)
-		return -EFAULT;
-	if (ret < requested_pages)
-		*iter_last_page_size = PAGE_SIZE;
-
-	return ret;
-}
-
-/* Populate the call parameters, merging adjacent pages together */
+/*
+ * Populate the call parameters, merging adjacent pages together, for |size|
+ * bytes of pages starting at offset |start| into the first page
+ */
 static void populate_rw_params(struct page **pages,
 			       int pages_count,
-			       unsigned long address,
-			       unsigned long address_end,
-			       unsigned long first_page,
-			       unsigned long last_page,
-			       unsigned int iter_last_page_size,
-			       int is_write,
+			       size_t start,
+			       size_t size,
 			       struct goldfish_pipe_command *command)
 {
 	/*
@@ -364,15 +376,14 @@ static void populate_rw_params(struct page **pages,
 	unsigned long xaddr_prev = xaddr;
 	int buffer_idx = 0;
 	int i = 1;
-	int size_on_page = first_page == last_page
-			? (int)(address_end - address)
-			: (PAGE_SIZE - (address & ~PAGE_MASK));
-	command->rw_params.ptrs[0] = (u64)(xaddr | (address & ~PAGE_MASK));
+	size_t size_on_page = min_t(size_t, size, PAGE_SIZE - start);
+
+	command->rw_params.ptrs[0] = (u64)(xaddr | start);
 	command->rw_params.sizes[0] = size_on_page;
+	size -= size_on_page;
 	for (; i < pages_count; ++i) {
 		xaddr = page_to_phys(pages[i]);
-		size_on_page = (i == pages_count - 1) ?
-			iter_last_page_size : PAGE_SIZE;
+		size_on_page = min_t(size_t, size, PAGE_SIZE);
 		if (xaddr == xaddr_prev + PAGE_SIZE) {
 			command->rw_params.sizes[buffer_idx] += size_on_page;
 		} else {
@@ -380,41 +391,43 @@ static void populate_rw_params(struct page **pages,
 			command->rw_params.ptrs[buffer_idx] = (u64)xaddr;
 			command->rw_params.sizes[buffer_idx] = size_on_page;
 		}
+		size -= size_on_page;
 		xaddr_prev = xaddr;
 	}
 	command->rw_params.buffers_count = buffer_idx + 1;
 }
 
+/*
+ * Hands up to MAX_BUFFERS_PER_COMMAND pages of |iter| to the host, and
+ * advances it by what the host consumed. User memory is pinned (FOLL_PIN)
+ * while the host accesses it by physical address. Kernel pages (ITER_BVEC,
+ * ITER_KVEC) are handed to the host as they are, so an in-kernel reader gets
+ * the data straight into its own pages.
+ */
 static int transfer_max_buffers(struct goldfish_pipe *pipe,
-				unsigned long address,
-				unsigned long address_end,
+				struct iov_iter *iter,
 				int is_write,
-				unsigned long last_page,
-				unsigned int last_page_size,
 				s32 *consumed_size,
 				int *status)
 {
-	unsigned long first_page = address & PAGE_MASK;
-	unsigned int iter_last_page_size;
+	struct page **pages = pipe->pages;
+	size_t start;
+	ssize_t size;
 	int pages_count;
 
 	/* Serialize access to the pipe command buffers */
 	if (mutex_lock_interruptible(&pipe->lock))
 		return -ERESTARTSYS;
 
-	pages_count = goldfish_pin_user_pages(first_page,
-					      last_page,
-					      last_page_size,
-					      is_write,
-					      pipe->pages,
-					      &iter_last_page_size);
-	if (pages_count < 0) {
+	size = iov_iter_extract_pages(iter, &pages, iov_iter_count(iter),
+				      MAX_BUFFERS_PER_COMMAND, 0, &start);
+	if (size <= 0) {
 		mutex_unlock(&pipe->lock);
-		return pages_count;
+		return size < 0 ? size : -EFAULT;
 	}
+	pages_count = DIV_ROUND_UP(start + size, PAGE_SIZE);
 
-	populate_rw_params(pipe->pages, pages_count, address, address_end,
-			   first_page, last_page, iter_last_page_size, is_write,
+	populate_rw_params(pages, pages_count, start, size,
 			   pipe->command_buffer);
 
 	/* Transfer the data */
@@ -423,8 +436,13 @@ static int transfer_max_buffers(struct goldfish_pipe *pipe,
 
 	*consumed_size = pipe->command_buffer->rw_params.consumed_size;
 
-	unpin_user_pages_dirty_lock(pipe->pages, pages_count,
-				    !is_write && (*consumed_size > 0));
+	/* iov_iter_extract_pages() advanced over all of it */
+	if (*consumed_size < size)
+		iov_iter_revert(iter, size - max(*consumed_size, 0));
+
+	if (iov_iter_extract_will_pin(iter))
+		unpin_user_pages_dirty_lock(pages, pages_count,
+					    !is_write && (*consumed_size > 0));
 
 	mutex_unlock(&pipe->lock);
 	return 0;
@@ -452,37 +470,26 @@ static int wait_for_host_signal(struct goldfish_pipe *pipe, int is_write)
 	return 0;
 }
 
-static ssize_t goldfish_pipe_read_write(struct file *filp,
-					char __user *buffer,
-					size_t bufflen,
-					int is_write)
+static ssize_t goldfish_pipe_transfer(struct goldfish_pipe *pipe,
+				      struct iov_iter *iter,
+				      bool nonblock,
+				      int is_write)
 {
-	struct goldfish_pipe *pipe = filp->private_data;
-	int count = 0, ret = -EINVAL;
-	unsigned long address, address_end, last_page;
-	unsigned int last_page_size;
+	ssize_t count = 0;
+	int ret = -EINVAL;
 
 	/* If the emulator already closed the pipe, no need to go further */
 	if (unlikely(test_bit(BIT_CLOSED_ON_HOST, &pipe->flags)))
 		return -EIO;
 	/* Null reads or writes succeeds */
-	if (unlikely(bufflen == 0))
+	if (unlikely(iov_iter_count(iter) == 0))
 		return 0;
-	/* Check the buffer range for access */
-	if (unlikely(!access_ok(buffer, bufflen)))
-		return -EFAULT;
-
-	address = (unsigned long)buffer;
-	address_end = address + bufflen;
-	last_page = (address_end - 1) & PAGE_MASK;
-	last_page_size = ((address_end - 1) & ~PAGE_MASK) + 1;
 
-	while (address < address_end) {
+	while (iov_iter_count(iter)) {
 		s32 consumed_size;
 		int status;
 
-		ret = transfer_max_buffers(pipe, address, address_end, is_write,
-					   last_page, last_page_size,
+		ret = transfer_max_buffers(pipe, iter, is_write,
 					   &consumed_size, &status);
 		if (ret < 0)
 			break;
@@ -492,7 +499,6 @@ static ssize_t goldfish_pipe_read_write(struct file *filp,
 			 * something.
 			 */
 			count += consumed_size;
-			address += consumed_size;
 		}
 		if (status > 0)
 			continue;
@@ -519,8 +525,7 @@ static ssize_t goldfish_pipe_read_write(struct file *filp,
 		 * If the error is not PIPE_ERROR_AGAIN, or if we are in
 		 * non-blocking mode, just return the error code.
 		 */
-		if (status != PIPE_ERROR_AGAIN ||
-			(filp->f_flags & O_NONBLOCK) != 0) {
+		if (status != PIPE_ERROR_AGAIN || nonblock) {
 			ret = goldfish_pipe_error_convert(status);
 			break;
 		}
@@ -535,9 +540,339 @@ static ssize_t goldfish_pipe_read_write(struct file *filp,
 	return ret;
 }
 
+static ssize_t goldfish_pipe_read_write(struct file *filp,
+					char __user *buffer,
+					size_t bufflen,
+					int is_write)
+{
+	struct iov_iter iter;
+	int ret;
+
+	/* Checks the buffer range for access */
+	ret = import_ubuf(is_write ? ITER_SOURCE : ITER_DEST, buffer, bufflen,
+			  &iter);
+	if (unlikely(ret))
+		return ret;
+
+	return goldfish_pipe_transfer(filp->private_data, &iter,
+				      (filp->f_flags & O_NONBLOCK) != 0,
+				      is_write);
+}
+
+static ssize_t goldfish_pipe_read_write_iter(struct kiocb *iocb,
+					     struct iov_iter *iter,
+					     int is_write)
+{
+	struct file *filp = iocb->ki_filp;
+
+	return goldfish_pipe_transfer(filp->private_data, iter,
+				      (filp->f_flags & O_NONBLOCK) != 0 ||
+				      (iocb->ki_flags & IOCB_NOWAIT) != 0,
+				      is_write);
+}
+
+/*
+ * Hands the corked bytes to the host, from the (physically contiguous)
+ * kernel buffer. With |wait|, waits for the host to take all of them,
+ * otherwise returns -EAGAIN if it won't right now. Called with wlock held.
+ */
+static int goldfish_pipe_flush_locked(struct goldfish_pipe *pipe, bool wait)
+{
+	struct goldfish_pipe_command *command = pipe->command_buffer;
+	int ret;
+
+	while (pipe->wbuf_len) {
+		s32 consumed_size;
+		int status;
+
+		if (mutex_lock_interruptible(&pipe->lock))
+			return -ERESTARTSYS;
+		command->rw_params.ptrs[0] =
+			(u64)__pa(pipe->wbuf + pipe->wbuf_off);
+		command->rw_params.sizes[0] = pipe->wbuf_len;
+		command->rw_params.buffers_count = 1;
+		status = goldfish_pipe_cmd_locked(pipe, PIPE_CMD_WRITE);
+		consumed_size = command->rw_params.consumed_size;
+		mutex_unlock(&pipe->lock);
+
+		if (consumed_size > 0) {
+			consumed_size = min_t(u32, consumed_size,
+					      pipe->wbuf_len);
+			pipe->wbuf_off += consumed_size;
+			pipe->wbuf_len -= consumed_size;
+		}
+		if (status > 0)
+			continue;
+		if (status == 0)
+			return -EIO;
+		if (status != PIPE_ERROR_AGAIN)
+			return goldfish_pipe_error_convert(status);
+		if (!wait)
+			return -EAGAIN;
+
+		ret = wait_for_host_signal(pipe, /* is_write */ 1);
+		if (ret < 0)
+			return ret;
+	}
+	pipe->wbuf_off = 0;
+	return 0;
+}
+
+/* Flushes the corked bytes, before a read or on GOLDFISH_PIPE_IOC_FLUSH */
+static int goldfish_pipe_flush(struct goldfish_pipe *pipe, bool wait)
+{
+	int ret;
+
+	if (!READ_ONCE(pipe->wbuf))
+		return 0;
+	if (mutex_lock_interruptible(&pipe->wlock))
+		return -ERESTARTSYS;
+	ret = goldfish_pipe_flush_locked(pipe, wait);
+	if (ret == -EAGAIN)
+		/* leave it to the timer */
+		schedule_delayed_work(&pipe->cork_work, pipe->wbuf_delay);
+	mutex_unlock(&pipe->wlock);
+	return ret;
+}
+
+static void goldfish_pipe_cork_work(struct work_struct *work)
+{
+	struct goldfish_pipe *pipe =
+		container_of(to_delayed_work(work), struct goldfish_pipe,
+			     cork_work);
+	int ret;
+
+	mutex_lock(&pipe->wlock);
+	ret = goldfish_pipe_flush_locked(pipe, /* wait */ false);
+	if (ret == -EAGAIN)
+		schedule_delayed_work(&pipe->cork_work, pipe->wbuf_delay);
+	else if (ret < 0)
+		pipe->wbuf_err = ret;
+	mutex_unlock(&pipe->wlock);
+}
+
+static ssize_t goldfish_pipe_write_corked(struct file *filp,
+					  const char __user *buffer,
+					  size_t bufflen)
+{
+	struct goldfish_pipe *pipe = filp->private_data;
+	bool wait = !(filp->f_flags & O_NONBLOCK);
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&pipe->wlock))
+		return -ERESTARTSYS;
+	if (pipe->wbuf_err) {
+		ret = pipe->wbuf_err;
+		pipe->wbuf_err = 0;
+		goto out;
+	}
+
+	if (pipe->wbuf && pipe->wbuf_len + bufflen > pipe->wbuf_size) {
+		ret = goldfish_pipe_flush_locked(pipe, wait);
+		if (ret < 0)
+			goto out;
+	}
+	if (!pipe->wbuf || bufflen > pipe->wbuf_size) {
+		/* uncorked meanwhile, or too large to be worth a copy */
+		ret = goldfish_pipe_read_write(filp, (char __user *)buffer,
+					       bufflen, /* is_write */ 1);
+		goto out;
+	}
+
+	if (pipe->wbuf_off + pipe->wbuf_len + bufflen > pipe->wbuf_size) {
+		memmove(pipe->wbuf, pipe->wbuf + pipe->wbuf_off,
+			pipe->wbuf_len);
+		pipe->wbuf_off = 0;
+	}
+	if (copy_from_user(pipe->wbuf + pipe->wbuf_off + pipe->wbuf_len,
+			   buffer, bufflen)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	pipe->wbuf_len += bufflen;
+	ret = bufflen;
+
+	if (pipe->wbuf_len == pipe->wbuf_size &&
+	    goldfish_pipe_flush_locked(pipe, /* wait */ false) == 0)
+		goto out;
+	schedule_delayed_work(&pipe->cork_work, pipe->wbuf_delay);
+
+out:
+	mutex_unlock(&pipe->wlock);
+	return ret;
+}
+
+/* Called on GOLDFISH_PIPE_IOC_SET_CORK */
+static long goldfish_pipe_set_cork(struct goldfish_pipe *pipe,
+				   struct goldfish_pipe_cork __user *arg)
+{
+	struct goldfish_pipe_cork cork;
+	char *wbuf = NULL;
+	long ret;
+
+	if (copy_from_user(&cork, arg, sizeof(cork)))
+		return -EFAULT;
+	if (cork.size > GOLDFISH_PIPE_CORK_SIZE_MAX || cork.flags)
+		return -EINVAL;
+	if (cork.size) {
+		/* kmalloc() memory is physically contiguous */
+		wbuf = kmalloc(cork.size, GFP_KERNEL);
+		if (!wbuf)
+			return -ENOMEM;
+	}
+
+	if (mutex_lock_interruptible(&pipe->wlock)) {
+		kfree(wbuf);
+		return -ERESTARTSYS;
+	}
+	ret = goldfish_pipe_flush_locked(pipe, /* wait */ true);
+	if (ret < 0) {
+		mutex_unlock(&pipe->wlock);
+		kfree(wbuf);
+		return ret;
+	}
+	kfree(pipe->wbuf);
+	WRITE_ONCE(pipe->wbuf, wbuf);
+	pipe->wbuf_size = cork.size;
+	pipe->wbuf_delay = usecs_to_jiffies(cork.delay_us ?:
+					    GOLDFISH_PIPE_CORK_DELAY_US);
+	mutex_unlock(&pipe->wlock);
+	return 0;
+}
+
+/*
+ * Fills the empty read-ahead buffer with a single host read. Returns the
+ * number of bytes read, 0 at EOF. Called with rlock held.
+ */
+static int goldfish_pipe_refill_locked(struct goldfish_pipe *pipe, bool wait)
+{
+	struct goldfish_pipe_command *command = pipe->command_buffer;
+	int ret;
+
+	for (;;) {
+		s32 consumed_size;
+		int status;
+
+		if (mutex_lock_interruptible(&pipe->lock))
+			return -ERESTARTSYS;
+		command->rw_params.ptrs[0] = (u64)__pa(pipe->rbuf);
+		command->rw_params.sizes[0] = pipe->rbuf_size;
+		command->rw_params.buffers_count = 1;
+		status = goldfish_pipe_cmd_locked(pipe, PIPE_CMD_READ);
+		consumed_size = command->rw_params.consumed_size;
+		mutex_unlock(&pipe->lock);
+
+		if (consumed_size > 0) {
+			pipe->rbuf_off = 0;
+			pipe->rbuf_len = min_t(u32, consumed_size,
+					       pipe->rbuf_size);
+			return pipe->rbuf_len;
+		}
+		if (status > 0)
+			continue;
+		if (status == 0)
+			return 0;
+		if (status != PIPE_ERROR_AGAIN)
+			return goldfish_pipe_error_convert(status);
+		if (!wait)
+			return -EAGAIN;
+
+		ret = wait_for_host_signal(pipe, /* is_write */ 0);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+/*
+ * Serves a read() from the read-ahead buffer, refilling it when it is
+ * empty. Reads at least as large as the buffer go straight to the host.
+ */
+static ssize_t goldfish_pipe_read_ahead(struct file *filp,
+					char __user *buffer, size_t bufflen)
+{
+	struct goldfish_pipe *pipe = filp->private_data;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&pipe->rlock))
+		return -ERESTARTSYS;
+
+	if (pipe->rbuf && !pipe->rbuf_len && bufflen < pipe->rbuf_size) {
+		ret = goldfish_pipe_refill_locked(pipe,
+					!(filp->f_flags & O_NONBLOCK));
+		if (ret <= 0)
+			goto out;
+	}
+	if (pipe->rbuf_len) {
+		ret = min_t(size_t, bufflen, pipe->rbuf_len);
+		if (copy_to_user(buffer, pipe->rbuf + pipe->rbuf_off, ret)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		pipe->rbuf_off += ret;
+		pipe->rbuf_len -= ret;
+		goto out;
+	}
+	ret = goldfish_pipe_read_write(filp, buffer, bufflen,
+				       /* is_write */ 0);
+
+out:
+	mutex_unlock(&pipe->rlock);
+	return ret;
+}
+
+/* Called on GOLDFISH_PIPE_IOC_SET_READAHEAD */
+static long
+goldfish_pipe_set_readahead(struct goldfish_pipe *pipe,
+			    struct goldfish_pipe_readahead __user *arg)
+{
+	struct goldfish_pipe_readahead ra;
+	char *rbuf = NULL;
+
+	if (copy_from_user(&ra, arg, sizeof(ra)))
+		return -EFAULT;
+	if (ra.size > GOLDFISH_PIPE_READAHEAD_SIZE_MAX || ra.flags)
+		return -EINVAL;
+	if (ra.size) {
+		/* kmalloc() memory is physically contiguous */
+		rbuf = kmalloc(ra.size, GFP_KERNEL);
+		if (!rbuf)
+			return -ENOMEM;
+	}
+
+	if (mutex_lock_interruptible(&pipe->rlock)) {
+		kfree(rbuf);
+		return -ERESTARTSYS;
+	}
+	/* what has been read ahead must not get lost */
+	if (pipe->rbuf_len > ra.size) {
+		mutex_unlock(&pipe->rlock);
+		kfree(rbuf);
+		return -EBUSY;
+	}
+	if (pipe->rbuf_len)
+		memcpy(rbuf, pipe->rbuf + pipe->rbuf_off, pipe->rbuf_len);
+	kfree(pipe->rbuf);
+	WRITE_ONCE(pipe->rbuf, rbuf);
+	pipe->rbuf_size = ra.size;
+	pipe->rbuf_off = 0;
+	mutex_unlock(&pipe->rlock);
+	return 0;
+}
+
 static ssize_t goldfish_pipe_read(struct file *filp, char __user *buffer,
 				  size_t bufflen, loff_t *ppos)
 {
+	struct goldfish_pipe *pipe = filp->private_data;
+	int ret;
+
+	/* the host may be waiting for what we corked, before it replies */
+	ret = goldfish_pipe_flush(pipe, !(filp->f_flags & O_NONBLOCK));
+	if (ret < 0 && ret != -EAGAIN)
+		return ret;
+
+	if (READ_ONCE(pipe->rbuf))
+		return goldfish_pipe_read_ahead(filp, buffer, bufflen);
+
 	return goldfish_pipe_read_write(filp, buffer, bufflen,
 					/* is_write */ 0);
 }
@@ -546,13 +881,169 @@ static ssize_t goldfish_pipe_write(struct file *filp,
 				   const char __user *buffer, size_t bufflen,
 				   loff_t *ppos)
 {
+	struct goldfish_pipe *pipe = filp->private_data;
 	/* cast away the const */
 	char __user *no_const_buffer = (char __user *)buffer;
 
+	if (READ_ONCE(pipe->wbuf))
+		return goldfish_pipe_write_corked(filp, buffer, bufflen);
+
 	return goldfish_pipe_read_write(filp, no_const_buffer, bufflen,
 					/* is_write */ 1);
 }
 
+/*
+ * Used by writev(), and by splice()/sendfile() through
+ * iter_file_splice_write(), which passes the pages to send in a bvec.
+ */
+static ssize_t goldfish_pipe_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct goldfish_pipe *pipe = filp->private_data;
+	bool wait = !(filp->f_flags & O_NONBLOCK) &&
+		    !(iocb->ki_flags & IOCB_NOWAIT);
+	ssize_t ret;
+
+	if (!READ_ONCE(pipe->wbuf))
+		return goldfish_pipe_read_write_iter(iocb, from,
+						     /* is_write */ 1);
+
+	/* what was corked goes first, and nothing gets corked meanwhile */
+	if (mutex_lock_interruptible(&pipe->wlock))
+		return -ERESTARTSYS;
+	if (pipe->wbuf_err) {
+		ret = pipe->wbuf_err;
+		pipe->wbuf_err = 0;
+		goto out;
+	}
+	ret = goldfish_pipe_flush_locked(pipe, wait);
+	if (ret == -EAGAIN)
+		schedule_delayed_work(&pipe->cork_work, pipe->wbuf_delay);
+	if (ret < 0)
+		goto out;
+	ret = goldfish_pipe_read_write_iter(iocb, from, /* is_write */ 1);
+
+out:
+	mutex_unlock(&pipe->wlock);
+	return ret;
+}
+
+/*
+ * Used by readv(), by splice()/sendfile() through copy_splice_read(),
+ * and by in-kernel readers that want the host to write into their own
+ * pages (e.g. a v4l2loopback device fed from a pipe).
+ */
+static ssize_t goldfish_pipe_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct goldfish_pipe *pipe = filp->private_data;
+	ssize_t count;
+	int ret;
+
+	ret = goldfish_pipe_flush(pipe,
+				  !(filp->f_flags & O_NONBLOCK) &&
+				  !(iocb->ki_flags & IOCB_NOWAIT));
+	if (ret < 0 && ret != -EAGAIN)
+		return ret;
+
+	/* hand out what has been read ahead first; don't refill, as the
+	 * readers of this path want the host to fill their own pages */
+	if (READ_ONCE(pipe->rbuf_len)) {
+		if (mutex_lock_interruptible(&pipe->rlock))
+			return -ERESTARTSYS;
+		count = copy_to_iter(pipe->rbuf + pipe->rbuf_off,
+				     pipe->rbuf_len, to);
+		pipe->rbuf_off += count;
+		pipe->rbuf_len -= count;
+		mutex_unlock(&pipe->rlock);
+		if (count > 0)
+			return count;
+	}
+
+	return goldfish_pipe_read_write_iter(iocb, to, /* is_write */ 0);
+}
+
+/*
+ * Sends the "pipe:<service>" string that connects a new pipe from a kernel
+ * buffer, in a single command, rather than going through the user pages
+ * of a write().
+ */
+static long goldfish_pipe_connect(struct goldfish_pipe *pipe,
+				  struct goldfish_pipe_connect __user *arg)
+{
+	static const char prefix[] = "pipe:";
+	struct goldfish_pipe_command *command = pipe->command_buffer;
+	size_t len;
+	char *msg;
+	int status;
+	long ret;
+
+	/* kmalloc() memory is physically contiguous */
+	msg = kmalloc(sizeof(prefix) + GOLDFISH_PIPE_SERVICE_NAME_MAX,
+		      GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+	memcpy(msg, prefix, sizeof(prefix) - 1);
+	if (copy_from_user(msg + sizeof(prefix) - 1, arg->service,
+			   GOLDFISH_PIPE_SERVICE_NAME_MAX)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	len = strnlen(msg, sizeof(prefix) - 1 +
+			   GOLDFISH_PIPE_SERVICE_NAME_MAX);
+	if (len == sizeof(prefix) - 1 ||
+	    len == sizeof(prefix) - 1 + GOLDFISH_PIPE_SERVICE_NAME_MAX) {
+		ret = -EINVAL;
+		goto out;
+	}
+	/* the host expects the terminating NUL too */
+	len++;
+
+	if (mutex_lock_interruptible(&pipe->lock)) {
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+	command->rw_params.ptrs[0] = (u64)__pa(msg);
+	command->rw_params.sizes[0] = len;
+	command->rw_params.buffers_count = 1;
+	status = goldfish_pipe_cmd_locked(pipe, PIPE_CMD_WRITE);
+	if (status < 0)
+		ret = goldfish_pipe_error_convert(status);
+	else if (command->rw_params.consumed_size != (s32)len)
+		ret = -EIO;
+	else
+		ret = 0;
+	mutex_unlock(&pipe->lock);
+
+out:
+	kfree(msg);
+	return ret;
+}
+
+static long goldfish_pipe_ioctl(struct file *filp, unsigned int cmd,
+				unsigned long arg)
+{
+	struct goldfish_pipe *pipe = filp->private_data;
+
+	if (unlikely(test_bit(BIT_CLOSED_ON_HOST, &pipe->flags)))
+		return -EIO;
+
+	switch (cmd) {
+	case GOLDFISH_PIPE_IOC_CONNECT:
+		return goldfish_pipe_connect(pipe, (void __user *)arg);
+	case GOLDFISH_PIPE_IOC_SET_CORK:
+		return goldfish_pipe_set_cork(pipe, (void __user *)arg);
+	case GOLDFISH_PIPE_IOC_FLUSH:
+		return goldfish_pipe_flush(pipe,
+					   !(filp->f_flags & O_NONBLOCK));
+	case GOLDFISH_PIPE_IOC_SET_READAHEAD:
+		return goldfish_pipe_set_readahead(pipe, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static unsigned int goldfish_pipe_poll(struct file *filp, poll_table *wait)
 {
 	struct goldfish_pipe *pipe = filp->private_data;
@@ -565,7 +1056,7 @@ static unsigned int goldfish_pipe_poll(struct file *filp, poll_table *wait)
 	if (status < 0)
 		return -ERESTARTSYS;
 
-	if (status & PIPE_POLL_IN)
+	if ((status & PIPE_POLL_IN) || READ_ONCE(pipe->rbuf_len))
 		mask |= POLLIN | POLLRDNORM;
 	if (status & PIPE_POLL_OUT)
 		mask |= POLLOUT | POLLWRNORM;
@@ -767,6 +1258,9 @@ static int goldfish_pipe_open(struct inode *inode, struct file *file)
 
 	pipe->dev = dev;
 	mutex_init(&pipe->lock);
+	mutex_init(&pipe->wlock);
+	mutex_init(&pipe->rlock);
+	INIT_DELAYED_WORK(&pipe->cork_work, goldfish_pipe_cork_work);
 	init_waitqueue_head(&pipe->wake_queue);
 
 	/*
@@ -824,6 +1318,14 @@ static int goldfish_pipe_release(struct inode *inode, struct file *filp)
 	struct goldfish_pipe *pipe = filp->private_data;
 	struct goldfish_pipe_dev *dev = pipe->dev;
 
+	/* Last chance for corked data, if the host takes it right away */
+	cancel_delayed_work_sync(&pipe->cork_work);
+	mutex_lock(&pipe->wlock);
+	goldfish_pipe_flush_locked(pipe, /* wait */ false);
+	mutex_unlock(&pipe->wlock);
+	kfree(pipe->wbuf);
+	kfree(pipe->rbuf);
+
 	/* The guest is closing the channel, so tell the emulator right now */
 	goldfish_pipe_cmd(pipe, PIPE_CMD_CLOSE);
 
@@ -875,7 +1377,13 @@ static const struct file_operations goldfish_pipe_fops = {
 	.owner = THIS_MODULE,
 	.read = goldfish_pipe_read,
 	.write = goldfish_pipe_write,
+	.read_iter = goldfish_pipe_read_iter,
+	.write_iter = goldfish_pipe_write_iter,
+	.splice_read = copy_splice_read,
+	.splice_write = iter_file_splice_write,
 	.poll = goldfish_pipe_poll,
+	.unlocked_ioctl = goldfish_pipe_ioctl,
+	.compat_ioctl = goldfish_pipe_ioctl,
 	.open = goldfish_pipe_open,
 	.release = goldfish_pipe_release,
 };
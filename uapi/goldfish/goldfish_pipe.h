@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef UAPI_GOLDFISH_PIPE_H
+#define UAPI_GOLDFISH_PIPE_H
+
+#include <linux/types.h>
+
+#define GOLDFISH_PIPE_DEVICE_NAME "goldfish_pipe_dprctd"
+
+/* The longest service name GOLDFISH_PIPE_IOC_CONNECT takes,
+ * including the terminating NUL.
+ */
+#define GOLDFISH_PIPE_SERVICE_NAME_MAX	256
+
+struct goldfish_pipe_connect {
+	char service[GOLDFISH_PIPE_SERVICE_NAME_MAX];
+};
+
+/* Shares the magic of goldfish_sync, whose ioctls are numbered from 0;
+ * the pipe's are numbered from 0x10.
+ */
+#define GOLDFISH_PIPE_IOC_MAGIC	'@'
+
+/* Connects a freshly opened pipe to the host service "pipe:<service>",
+ * instead of write()ing that string.
+ */
+#define GOLDFISH_PIPE_IOC_CONNECT	\
+	_IOW(GOLDFISH_PIPE_IOC_MAGIC, 0x10, struct goldfish_pipe_connect)
+
+/* The largest write buffer GOLDFISH_PIPE_IOC_SET_CORK takes, and the
+ * delay used when none is given.
+ */
+#define GOLDFISH_PIPE_CORK_SIZE_MAX	65536
+#define GOLDFISH_PIPE_CORK_DELAY_US	1000
+
+struct goldfish_pipe_cork {
+	__u32 size;	/* of the write buffer, 0 to uncork */
+	__u32 delay_us;	/* before buffered bytes are sent anyway */
+	__u32 flags;	/* must be 0 */
+	__u32 reserved;
+};
+
+/* Coalesces small write()s in a kernel buffer of up to |size| bytes. It is
+ * sent to the host when it fills up, before each read(), on
+ * GOLDFISH_PIPE_IOC_FLUSH and at most |delay_us| (rounded up to a jiffy)
+ * after the first byte was buffered. Errors of delayed sends are reported
+ * by the next write().
+ */
+#define GOLDFISH_PIPE_IOC_SET_CORK	\
+	_IOW(GOLDFISH_PIPE_IOC_MAGIC, 0x11, struct goldfish_pipe_cork)
+
+/* Sends the buffered bytes now */
+#define GOLDFISH_PIPE_IOC_FLUSH		_IO(GOLDFISH_PIPE_IOC_MAGIC, 0x12)
+
+/* The largest buffer GOLDFISH_PIPE_IOC_SET_READAHEAD takes */
+#define GOLDFISH_PIPE_READAHEAD_SIZE_MAX	65536
+
+struct goldfish_pipe_readahead {
+	__u32 size;	/* of the read-ahead buffer, 0 to turn it off */
+	__u32 flags;	/* must be 0 */
+	__u32 reserved[2];
+};
+
+/* Serves read()s smaller than |size| from a kernel buffer that is filled
+ * with as much as the host has, up to |size| bytes, in one go. Fails with
+ * EBUSY if more than |size| bytes have been read ahead already.
+ */
+#define GOLDFISH_PIPE_IOC_SET_READAHEAD	\
+	_IOW(GOLDFISH_PIPE_IOC_MAGIC, 0x13, struct goldfish_pipe_readahead)
+
+#endif /* UAPI_GOLDFISH_PIPE_H */
@@ -0,0 +1,820 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * v4l2loopback-bench.c
+ *
+ * producer/consumer benchmark for v4l2loopback devices
+ *
+ * for each combination of frame size, format, producer I/O (mmap QBUF or
+ * write()), reader I/O (mmap DQBUF or read()) and number of readers, a
+ * device is created with V4L2LOOPBACK_CTL_ADD (unless one is given with -d),
+ * a producer thread pushes frames and the readers pull them, and a line
+ * with the results is printed:
+ * - fps of the producer, and (the average of) the readers
+ * - the share of frames the readers missed
+ * - the latency from the producer queueing a frame to a reader getting it
+ *   (every frame carries its sequence number and CLOCK_MONOTONIC time)
+ * - the CPU time (user+system) per frame, of the producer and of a reader;
+ *   the frames are not touched beyond their header, so this is mostly what
+ *   the driver costs
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "v4l2loopback.h"
+
+#define CONTROL_DEVICE "/dev/v4l2loopback"
+#define MAX_LIST 16
+#define MAX_READERS 64
+#define MAX_MMAP_BUFFERS 8
+#define POLL_MS 100
+
+/* at the start of every frame */
+struct frame_stamp {
+	uint64_t sequence; /* 0 for the frame that gets the readers going */
+	uint64_t ns;
+};
+
+enum io { IO_MMAP, IO_RW };
+
+struct frame_size {
+	unsigned int width;
+	unsigned int height;
+};
+
+struct run {
+	const char *device;
+	struct frame_size size;
+	uint32_t fourcc;
+	enum io producer_io;
+	enum io reader_io;
+	int readers;
+	int frames;
+	int fps;
+
+	size_t sizeimage;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int ready; /* the first frame is out, the readers may open */
+	int streaming; /* readers that are waiting for frames */
+	atomic_int stop;
+	int failed;
+
+	/* results of the producer */
+	double elapsed; /* seconds */
+	double producer_cpu; /* seconds */
+};
+
+struct reader {
+	struct run *run;
+	pthread_t thread;
+	unsigned long received;
+	unsigned long missed;
+	double cpu;
+	uint64_t *latencies; /* ns, one per received frame */
+	int err;
+};
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/* waits until fd is readable, or the run is over; returns 0 if it is */
+static int wait_readable(struct run *run, int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (!atomic_load(&run->stop)) {
+		int ret = poll(&pfd, 1, POLL_MS);
+
+		if (ret > 0)
+			return 0;
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+	return -EAGAIN;
+}
+
+static void fail(struct run *run, const char *what, int err)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(err));
+	pthread_mutex_lock(&run->mutex);
+	run->failed = 1;
+	run->ready = 1;
+	pthread_cond_broadcast(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+	atomic_store(&run->stop, 1);
+}
+
+static void account(struct reader *r, const struct frame_stamp *stamp,
+		    uint64_t *last_sequence)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+
+	if (stamp->sequence == 0 || stamp->sequence <= *last_sequence)
+		return;
+	if (*last_sequence)
+		r->missed += stamp->sequence - *last_sequence - 1;
+	*last_sequence = stamp->sequence;
+	if (r->received < (unsigned long)r->run->frames)
+		r->latencies[r->received] = now - stamp->ns;
+	r->received++;
+}
+
+static int read_frames(struct reader *r, int fd)
+{
+	struct run *run = r->run;
+	uint64_t last_sequence = 0;
+	char *frame;
+	int err = 0;
+
+	frame = malloc(run->sizeimage);
+	if (!frame)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&run->mutex);
+	run->streaming++;
+	pthread_cond_broadcast(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+
+	while (!atomic_load(&run->stop)) {
+		ssize_t len;
+
+		err = wait_readable(run, fd);
+		if (err)
+			break;
+		len = read(fd, frame, run->sizeimage);
+		if (len < 0) {
+			err = -errno;
+			if (err == -EINTR || err == -EAGAIN)
+				continue;
+			break;
+		}
+		if ((size_t)len >= sizeof(struct frame_stamp))
+			account(r, (const struct frame_stamp *)frame,
+				&last_sequence);
+	}
+	free(frame);
+	return err == -EAGAIN ? 0 : err;
+}
+
+static int dequeue_frames(struct reader *r, int fd)
+{
+	struct run *run = r->run;
+	struct v4l2_requestbuffers req = {
+		.count = MAX_MMAP_BUFFERS,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	void *maps[MAX_MMAP_BUFFERS] = { 0 };
+	size_t lengths[MAX_MMAP_BUFFERS] = { 0 };
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	uint64_t last_sequence = 0;
+	unsigned int i;
+	int err = 0;
+
+	if (xioctl(fd, VIDIOC_REQBUFS, &req) < 0)
+		return -errno;
+	if (req.count > MAX_MMAP_BUFFERS)
+		req.count = MAX_MMAP_BUFFERS;
+	for (i = 0; i < req.count; i++) {
+		struct v4l2_buffer buf = {
+			.index = i,
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+
+		if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			err = -errno;
+			goto out_unmap;
+		}
+		maps[i] = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd,
+			       buf.m.offset);
+		if (maps[i] == MAP_FAILED) {
+			maps[i] = NULL;
+			err = -errno;
+			goto out_unmap;
+		}
+		lengths[i] = buf.length;
+		if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			err = -errno;
+			goto out_unmap;
+		}
+	}
+	if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+		err = -errno;
+		goto out_unmap;
+	}
+
+	pthread_mutex_lock(&run->mutex);
+	run->streaming++;
+	pthread_cond_broadcast(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+
+	while (!atomic_load(&run->stop)) {
+		struct v4l2_buffer buf = {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+
+		err = wait_readable(run, fd);
+		if (err)
+			break;
+		if (xioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			err = -errno;
+			if (err == -EAGAIN)
+				continue;
+			break;
+		}
+		if (buf.index < req.count &&
+		    buf.bytesused >= sizeof(struct frame_stamp))
+			account(r, maps[buf.index], &last_sequence);
+		if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			err = -errno;
+			break;
+		}
+	}
+	if (err == -EAGAIN)
+		err = 0;
+	xioctl(fd, VIDIOC_STREAMOFF, &type);
+
+out_unmap:
+	for (i = 0; i < MAX_MMAP_BUFFERS; i++)
+		if (maps[i])
+			munmap(maps[i], lengths[i]);
+	return err;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	struct run *run = r->run;
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	uint64_t cpu;
+	int fd;
+
+	pthread_mutex_lock(&run->mutex);
+	while (!run->ready)
+		pthread_cond_wait(&run->cond, &run->mutex);
+	pthread_mutex_unlock(&run->mutex);
+	if (run->failed)
+		return NULL;
+
+	fd = open(run->device, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		r->err = -errno;
+		fail(run, "open (reader)", errno);
+		return NULL;
+	}
+	if (xioctl(fd, VIDIOC_G_FMT, &fmt) < 0) {
+		r->err = -errno;
+		fail(run, "VIDIOC_G_FMT (reader)", errno);
+		close(fd);
+		return NULL;
+	}
+
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (run->reader_io == IO_MMAP)
+		r->err = dequeue_frames(r, fd);
+	else
+		r->err = read_frames(r, fd);
+	r->cpu = (now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu) / 1e9;
+	if (r->err)
+		fail(run, run->reader_io == IO_MMAP ? "VIDIOC_DQBUF" : "read",
+		     -r->err);
+	close(fd);
+	return NULL;
+}
+
+/* one frame: returns 0 or -errno */
+static int produce(struct run *run, int fd, void **maps, unsigned int count,
+		   void *frame, uint64_t sequence)
+{
+	struct frame_stamp *stamp;
+	struct v4l2_buffer buf = {
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+
+	if (run->producer_io == IO_RW) {
+		stamp = frame;
+		stamp->sequence = sequence;
+		stamp->ns = now_ns(CLOCK_MONOTONIC);
+		if (write(fd, frame, run->sizeimage) < 0)
+			return -errno;
+		return 0;
+	}
+
+	/* all buffers are queued once, then recycled */
+	if (sequence < count) {
+		buf.index = sequence;
+	} else if (xioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+		return -errno;
+	}
+	stamp = maps[buf.index];
+	stamp->sequence = sequence;
+	buf.bytesused = run->sizeimage;
+	buf.field = V4L2_FIELD_NONE;
+	stamp->ns = now_ns(CLOCK_MONOTONIC);
+	if (xioctl(fd, VIDIOC_QBUF, &buf) < 0)
+		return -errno;
+	return 0;
+}
+
+static void producer(struct run *run)
+{
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_OUTPUT };
+	struct v4l2_requestbuffers req = {
+		.count = MAX_MMAP_BUFFERS / 2,
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	void *maps[MAX_MMAP_BUFFERS] = { 0 };
+	size_t lengths[MAX_MMAP_BUFFERS] = { 0 };
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	uint64_t start, cpu, period_ns = 0;
+	void *frame = NULL;
+	unsigned int i;
+	int fd, err;
+
+	fd = open(run->device, O_RDWR);
+	if (fd < 0) {
+		fail(run, "open (producer)", errno);
+		return;
+	}
+	fmt.fmt.pix.width = run->size.width;
+	fmt.fmt.pix.height = run->size.height;
+	fmt.fmt.pix.pixelformat = run->fourcc;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+		fail(run, "VIDIOC_S_FMT", errno);
+		goto out_close;
+	}
+	if (fmt.fmt.pix.pixelformat != run->fourcc ||
+	    fmt.fmt.pix.width != run->size.width ||
+	    fmt.fmt.pix.height != run->size.height) {
+		fail(run, "VIDIOC_S_FMT", EINVAL);
+		goto out_close;
+	}
+	run->sizeimage = fmt.fmt.pix.sizeimage;
+
+	if (run->producer_io == IO_RW) {
+		frame = calloc(1, run->sizeimage);
+		if (!frame) {
+			fail(run, "calloc", ENOMEM);
+			goto out_close;
+		}
+	} else {
+		if (xioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+			fail(run, "VIDIOC_REQBUFS", errno);
+			goto out_close;
+		}
+		if (req.count > MAX_MMAP_BUFFERS)
+			req.count = MAX_MMAP_BUFFERS;
+		for (i = 0; i < req.count; i++) {
+			struct v4l2_buffer buf = {
+				.index = i,
+				.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+				.memory = V4L2_MEMORY_MMAP,
+			};
+
+			if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+				fail(run, "VIDIOC_QUERYBUF", errno);
+				goto out_unmap;
+			}
+			maps[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+				       MAP_SHARED, fd, buf.m.offset);
+			if (maps[i] == MAP_FAILED) {
+				maps[i] = NULL;
+				fail(run, "mmap", errno);
+				goto out_unmap;
+			}
+			lengths[i] = buf.length;
+			memset(maps[i], 0, buf.length);
+		}
+		if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+			fail(run, "VIDIOC_STREAMON", errno);
+			goto out_unmap;
+		}
+	}
+
+	/* the readers can only open once there is a frame */
+	err = produce(run, fd, maps, req.count, frame, 0);
+	if (err) {
+		fail(run, "producer", -err);
+		goto out_unmap;
+	}
+	pthread_mutex_lock(&run->mutex);
+	run->ready = 1;
+	pthread_cond_broadcast(&run->cond);
+	while (run->streaming < run->readers && !run->failed)
+		pthread_cond_wait(&run->cond, &run->mutex);
+	pthread_mutex_unlock(&run->mutex);
+	if (run->failed)
+		goto out_unmap;
+
+	if (run->fps > 0)
+		period_ns = 1000000000ull / run->fps;
+	start = now_ns(CLOCK_MONOTONIC);
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	for (i = 1; i <= (unsigned int)run->frames; i++) {
+		if (period_ns) {
+			uint64_t due = start + (i - 1) * period_ns;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000ull,
+				.tv_nsec = due % 1000000000ull,
+			};
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+		err = produce(run, fd, maps, req.count, frame, i);
+		if (err) {
+			fail(run, "producer", -err);
+			break;
+		}
+	}
+	run->producer_cpu = (now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu) / 1e9;
+	run->elapsed = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+
+	/* let the readers pick up the last frames */
+	usleep(POLL_MS * 1000);
+	atomic_store(&run->stop, 1);
+	if (run->producer_io == IO_MMAP)
+		xioctl(fd, VIDIOC_STREAMOFF, &type);
+
+out_unmap:
+	for (i = 0; i < MAX_MMAP_BUFFERS; i++)
+		if (maps[i])
+			munmap(maps[i], lengths[i]);
+	free(frame);
+out_close:
+	close(fd);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static const char *io_name(enum io io, int producer)
+{
+	if (io == IO_MMAP)
+		return "mmap";
+	return producer ? "write" : "read";
+}
+
+static void print_header(void)
+{
+	printf("%-10s %-6s %-5s %-5s %3s %9s %9s %6s %9s %9s %9s %9s %9s %9s\n",
+	       "size", "format", "prod", "read", "rdr", "prod_fps",
+	       "read_fps", "miss%", "lat_avg", "lat_p50", "lat_p99",
+	       "lat_max", "cpu_prod", "cpu_read");
+	printf("%-10s %-6s %-5s %-5s %3s %9s %9s %6s %9s %9s %9s %9s %9s %9s\n",
+	       "", "", "", "", "", "", "", "", "[us]", "[us]", "[us]", "[us]",
+	       "[us/f]", "[us/f]");
+}
+
+static void print_result(const struct run *run, struct reader *readers)
+{
+	unsigned long received = 0, missed = 0, count = 0, i;
+	double reader_cpu = 0, sum = 0;
+	uint64_t *all;
+	char size[24], fourcc[5];
+	int r;
+
+	snprintf(size, sizeof(size), "%ux%u", run->size.width,
+		 run->size.height);
+	memcpy(fourcc, &run->fourcc, 4);
+	fourcc[4] = 0;
+	printf("%-10s %-6s %-5s %-5s %3d ", size, fourcc,
+	       io_name(run->producer_io, 1), io_name(run->reader_io, 0),
+	       run->readers);
+	if (run->failed) {
+		printf("FAILED\n");
+		return;
+	}
+
+	all = calloc((size_t)run->readers * run->frames, sizeof(*all));
+	for (r = 0; r < run->readers; r++) {
+		unsigned long n = readers[r].received;
+
+		if (n > (unsigned long)run->frames)
+			n = run->frames;
+		received += readers[r].received;
+		missed += readers[r].missed;
+		reader_cpu += readers[r].cpu;
+		for (i = 0; all && i < n; i++) {
+			all[count++] = readers[r].latencies[i];
+			sum += readers[r].latencies[i];
+		}
+	}
+	printf("%9.1f %9.1f %6.1f ", run->frames / run->elapsed,
+	       received / run->elapsed / run->readers,
+	       received + missed ? 100.0 * missed / (received + missed) : 0.0);
+	if (count) {
+		qsort(all, count, sizeof(*all), compare_u64);
+		printf("%9.1f %9.1f %9.1f %9.1f ", sum / count / 1e3,
+		       all[count / 2] / 1e3, all[count * 99 / 100] / 1e3,
+		       all[count - 1] / 1e3);
+	} else {
+		printf("%9s %9s %9s %9s ", "-", "-", "-", "-");
+	}
+	printf("%9.1f %9.1f\n", run->producer_cpu * 1e6 / run->frames,
+	       received ? reader_cpu * 1e6 / received : 0.0);
+	free(all);
+}
+
+/* creates a device that takes frames of the given size, returns its number */
+static int add_device(int ctl, const struct run *run)
+{
+	struct v4l2_loopback_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.output_nr = -1;
+	snprintf(cfg.card_label, sizeof(cfg.card_label), "v4l2loopback-bench");
+	cfg.max_width = run->size.width;
+	cfg.max_height = run->size.height;
+	cfg.max_buffers = MAX_MMAP_BUFFERS;
+	cfg.max_openers = run->readers + 4; /* and udev */
+	cfg.announce_all_caps = 1;
+	return xioctl(ctl, V4L2LOOPBACK_CTL_ADD, &cfg);
+}
+
+static void remove_device(int ctl, int nr)
+{
+	int tries;
+
+	/* udev might still have it open */
+	for (tries = 0; tries < 50; tries++) {
+		if (ioctl(ctl, V4L2LOOPBACK_CTL_REMOVE, nr) == 0 ||
+		    errno != EBUSY)
+			return;
+		usleep(20000);
+	}
+	fprintf(stderr, "cannot remove /dev/video%d: %s\n", nr,
+		strerror(errno));
+}
+
+/* returns 0 if the run went through */
+static int bench(int ctl, struct run *run)
+{
+	struct reader readers[MAX_READERS];
+	char device[32];
+	int nr = -1;
+	int i, tries;
+
+	if (!run->device) {
+		nr = add_device(ctl, run);
+		if (nr < 0) {
+			perror("V4L2LOOPBACK_CTL_ADD");
+			return -1;
+		}
+		snprintf(device, sizeof(device), "/dev/video%d", nr);
+		run->device = device;
+		/* wait for the node to show up */
+		for (tries = 0; tries < 50 && access(device, R_OK | W_OK);
+		     tries++)
+			usleep(20000);
+	}
+
+	pthread_mutex_init(&run->mutex, NULL);
+	pthread_cond_init(&run->cond, NULL);
+	memset(readers, 0, sizeof(readers));
+	for (i = 0; i < run->readers; i++) {
+		readers[i].run = run;
+		readers[i].latencies =
+			calloc(run->frames, sizeof(*readers[i].latencies));
+		if (!readers[i].latencies ||
+		    pthread_create(&readers[i].thread, NULL, reader_thread,
+				   &readers[i])) {
+			fail(run, "reader", ENOMEM);
+			run->readers = i;
+			free(readers[i].latencies);
+			break;
+		}
+	}
+	if (!run->failed)
+		producer(run);
+	atomic_store(&run->stop, 1);
+	for (i = 0; i < run->readers; i++)
+		pthread_join(readers[i].thread, NULL);
+
+	print_result(run, readers);
+	fflush(stdout);
+
+	for (i = 0; i < run->readers; i++)
+		free(readers[i].latencies);
+	pthread_cond_destroy(&run->cond);
+	pthread_mutex_destroy(&run->mutex);
+	if (nr >= 0) {
+		remove_device(ctl, nr);
+		run->device = NULL;
+	}
+	return run->failed ? -1 : 0;
+}
+
+static int parse_size(const char *arg, struct frame_size *size)
+{
+	if (!strcasecmp(arg, "720p")) {
+		*size = (struct frame_size){ 1280, 720 };
+	} else if (!strcasecmp(arg, "1080p")) {
+		*size = (struct frame_size){ 1920, 1080 };
+	} else if (!strcasecmp(arg, "4k") || !strcasecmp(arg, "2160p")) {
+		*size = (struct frame_size){ 3840, 2160 };
+	} else if (sscanf(arg, "%ux%u", &size->width, &size->height) != 2 ||
+		   !size->width || !size->height) {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_fourcc(const char *arg, uint32_t *fourcc)
+{
+	char c[4] = { ' ', ' ', ' ', ' ' };
+	size_t len = strlen(arg);
+
+	if (!len || len > 4)
+		return -1;
+	memcpy(c, arg, len);
+	*fourcc = v4l2_fourcc(c[0], c[1], c[2], c[3]);
+	return 0;
+}
+
+static int parse_io(const char *arg, enum io *io, int producer)
+{
+	if (!strcmp(arg, "mmap"))
+		*io = IO_MMAP;
+	else if (!strcmp(arg, producer ? "write" : "read"))
+		*io = IO_RW;
+	else
+		return -1;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DEVICE  use an existing device (e.g. /dev/video0), rather\n"
+		"             than one created through " CONTROL_DEVICE "\n"
+		"  -s SIZE    720p, 1080p, 4K or <width>x<height>\n"
+		"             [DEFAULT: 720p, 1080p and 4K]\n"
+		"  -f FOURCC  pixel format [DEFAULT: YUYV, NV12 and RGB3]\n"
+		"  -p IO      producer: mmap or write [DEFAULT: both]\n"
+		"  -c IO      readers: mmap or read [DEFAULT: both]\n"
+		"  -r N       runs with 1, 2, 4, ... up to N readers [DEFAULT: 4]\n"
+		"  -n FRAMES  frames per run [DEFAULT: 200]\n"
+		"  -F FPS     pace the producer [DEFAULT: as fast as possible]\n"
+		"-s, -f, -p and -c can be given several times\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct frame_size sizes[MAX_LIST];
+	uint32_t fourccs[MAX_LIST];
+	enum io producer_ios[2], reader_ios[2];
+	int nsizes = 0, nfourccs = 0, nproducer_ios = 0, nreader_ios = 0;
+	const char *device = NULL;
+	int max_readers = 4, frames = 200, fps = 0;
+	int ctl = -1, failed = 0;
+	int s, f, p, c, readers, opt;
+
+	while ((opt = getopt(argc, argv, "d:s:f:p:c:r:n:F:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			if (nsizes == MAX_LIST ||
+			    parse_size(optarg, &sizes[nsizes++])) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'f':
+			if (nfourccs == MAX_LIST ||
+			    parse_fourcc(optarg, &fourccs[nfourccs++])) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'p':
+			if (nproducer_ios == 2 ||
+			    parse_io(optarg, &producer_ios[nproducer_ios++], 1)) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'c':
+			if (nreader_ios == 2 ||
+			    parse_io(optarg, &reader_ios[nreader_ios++], 0)) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'r':
+			max_readers = atoi(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'F':
+			fps = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+	if (optind < argc || max_readers < 1 || max_readers > MAX_READERS ||
+	    frames < 1 || fps < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (!nsizes) {
+		parse_size("720p", &sizes[nsizes++]);
+		parse_size("1080p", &sizes[nsizes++]);
+		parse_size("4K", &sizes[nsizes++]);
+	}
+	if (!nfourccs) {
+		fourccs[nfourccs++] = V4L2_PIX_FMT_YUYV;
+		fourccs[nfourccs++] = V4L2_PIX_FMT_NV12;
+		fourccs[nfourccs++] = V4L2_PIX_FMT_RGB24;
+	}
+	if (!nproducer_ios) {
+		producer_ios[nproducer_ios++] = IO_MMAP;
+		producer_ios[nproducer_ios++] = IO_RW;
+	}
+	if (!nreader_ios) {
+		reader_ios[nreader_ios++] = IO_MMAP;
+		reader_ios[nreader_ios++] = IO_RW;
+	}
+
+	if (!device) {
+		ctl = open(CONTROL_DEVICE, O_RDWR);
+		if (ctl < 0) {
+			perror(CONTROL_DEVICE);
+			return 1;
+		}
+	}
+
+	print_header();
+	for (s = 0; s < nsizes; s++)
+		for (f = 0; f < nfourccs; f++)
+			for (p = 0; p < nproducer_ios; p++)
+				for (c = 0; c < nreader_ios; c++)
+					for (readers = 1;
+					     readers <= max_readers;
+					     readers *= 2) {
+						struct run run = {
+							.device = device,
+							.size = sizes[s],
+							.fourcc = fourccs[f],
+							.producer_io =
+								producer_ios[p],
+							.reader_io =
+								reader_ios[c],
+							.readers = readers,
+							.frames = frames,
+							.fps = fps,
+						};
+
+						if (bench(ctl, &run))
+							failed = 1;
+					}
+
+	if (ctl >= 0)
+		close(ctl);
+	return failed;
+}
@@ -22,8 +22,17 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/file.h>
+#include <linux/kthread.h>
+#include <linux/nodemask.h>
 #include <linux/capability.h>
 #include <linux/eventpoll.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-device.h>
@@ -32,6 +41,10 @@
 
 #include <linux/miscdevice.h>
 #include "v4l2loopback.h"
+#include <goldfish_address_space.h>
+
+#define CREATE_TRACE_POINTS
+#include "v4l2loopback_trace.h"
 
 #include <asm/div64.h>  /* do_div */
 
@@ -47,6 +60,17 @@
 #define VFL_TYPE_VIDEO VFL_TYPE_GRABBER
 #endif
 
+#ifndef ITER_DEST
+#define ITER_DEST READ
+#endif
+
+#if IS_ENABLED(CONFIG_SYNC_FILE) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
+#define V4L2LOOPBACK_WITH_FENCES
+#endif
+
 #define V4L2LOOPBACK_VERSION_CODE                                              \
 	KERNEL_VERSION(V4L2LOOPBACK_VERSION_MAJOR, V4L2LOOPBACK_VERSION_MINOR, \
 		       V4L2LOOPBACK_VERSION_BUGFIX)
@@ -113,7 +137,10 @@ typedef unsigned __poll_t;
  *	make KCPPFLAGS="-DMAX_DEVICES=100"
  */
 
-/* maximum number of v4l2loopback devices that can be created */
+/* maximum number of v4l2loopback devices that can be configured
+ * individually via the module parameters
+ * more devices (up to VIDEO_NUM_DEVICES) can be requested via the 'devices'
+ * parameter (they get default settings), or created at runtime */
 #ifndef MAX_DEVICES
 #define MAX_DEVICES 8
 #endif
@@ -162,6 +189,59 @@ MODULE_PARM_DESC(
 	"how many users can open the loopback device [DEFAULT: " __stringify(
 		V4L2LOOPBACK_DEFAULT_MAX_OPENERS) "]");
 
+/* how long (in seconds) a buffer may go without being written, before its
+ * memory is given back; it will be re-allocated on the next write */
+#define V4L2LOOPBACK_DEFAULT_RECLAIM_TIMEOUT 0
+static int reclaim_timeout = V4L2LOOPBACK_DEFAULT_RECLAIM_TIMEOUT;
+module_param(reclaim_timeout, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(
+	reclaim_timeout,
+	"free buffers that have not been written for that many seconds (0=never) [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_RECLAIM_TIMEOUT) "]");
+
+/* whether readers may ask for a pixel format other than the writer's, in
+ * which case the frames are converted in the driver */
+#define V4L2LOOPBACK_DEFAULT_CONVERT_FORMATS 1
+static bool convert_formats = V4L2LOOPBACK_DEFAULT_CONVERT_FORMATS;
+module_param(convert_formats, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(
+	convert_formats,
+	"let readers negotiate formats the writer doesn't produce [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_CONVERT_FORMATS) "]");
+
+/* whether frames live in memory shared with the host (goldfish address
+ * space), so the host can write them in place */
+#define V4L2LOOPBACK_DEFAULT_HOST_BUFFERS 0
+static bool host_buffers = V4L2LOOPBACK_DEFAULT_HOST_BUFFERS;
+module_param(host_buffers, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(
+	host_buffers,
+	"allocate frames from the goldfish address space, if available [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_HOST_BUFFERS) "]");
+
+/* whether frames that are written faster than the nominal frame rate are
+ * dropped right away, rather than copied for readers to skip them */
+#define V4L2LOOPBACK_DEFAULT_PACE_OUTPUT 0
+static bool pace_output = V4L2LOOPBACK_DEFAULT_PACE_OUTPUT;
+module_param(pace_output, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(
+	pace_output,
+	"drop frames written faster than the configured framerate [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_PACE_OUTPUT) "]");
+
+/* the NUMA node the frames of new devices are allocated on; can be changed
+ * per device in sysfs (frame_node), the node actually used is shown in
+ * frame_node_used */
+#define V4L2L_NODE_WRITER -1 /* wherever the writer runs */
+#define V4L2L_NODE_INTERLEAVE -2 /* spread over all online nodes */
+#define V4L2LOOPBACK_DEFAULT_FRAME_NODE V4L2L_NODE_WRITER
+static int frame_node = V4L2LOOPBACK_DEFAULT_FRAME_NODE;
+module_param(frame_node, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(
+	frame_node,
+	"NUMA node of the frame memory of new devices (-1=the writer's, -2=interleave) [DEFAULT: " __stringify(
+		V4L2LOOPBACK_DEFAULT_FRAME_NODE) "]");
+
 static int devices = -1;
 module_param(devices, int, 0);
 MODULE_PARM_DESC(devices, "how many devices should be created");
@@ -171,6 +251,12 @@ module_param_array(video_nr, int, NULL, 0444);
 MODULE_PARM_DESC(video_nr,
 		 "video device numbers (-1=auto, 0=/dev/video0, etc.)");
 
+static int capture_video_nr[MAX_DEVICES] = { [0 ...(MAX_DEVICES - 1)] = -1 };
+module_param_array(capture_video_nr, int, NULL, 0444);
+MODULE_PARM_DESC(
+	capture_video_nr,
+	"video device numbers of separate CAPTURE devices, if video_nr is set too (-1=none, video_nr does both)");
+
 static char *card_label[MAX_DEVICES];
 module_param_array(card_label, charp, NULL, 0000);
 MODULE_PARM_DESC(card_label, "card labels for each device");
@@ -205,7 +291,10 @@ MODULE_PARM_DESC(max_height,
 		 "maximum allowed frame height [DEFAULT: " __stringify(
 			 V4L2LOOPBACK_SIZE_DEFAULT_MAX_HEIGHT) "]");
 
+/* both IDRs are protected by v4l2loopback_ctl_mutex */
 static DEFINE_IDR(v4l2loopback_index_idr);
+/* maps the video device-number (/dev/video<nr>) to the device */
+static DEFINE_IDR(v4l2loopback_vdevnr_idr);
 static DEFINE_MUTEX(v4l2loopback_ctl_mutex);
 
 /* frame intervals */
@@ -275,6 +364,8 @@ static const struct v4l2_ctrl_config v4l2loopback_ctrl_timeoutimageio = {
 /* module structures */
 struct v4l2loopback_private {
 	int device_nr;
+	/* set before the node is registered, so it is there for any open() */
+	struct v4l2_loopback_device *dev;
 };
 
 /* TODO(vasaka) use typenames which are common to kernel, but first find out if
@@ -285,17 +376,92 @@ struct v4l2l_buffer {
 	struct v4l2_buffer buffer;
 	struct list_head list_head;
 	int use_count;
+	u8 *data; /* frame memory of this buffer, allocated on demand */
+	unsigned long size; /* size of data */
+	struct page **pages; /* pages backing data, for mmap */
+	/* the goldfish address space block backing data, if vaddr is set;
+	 * pages is NULL then */
+	struct goldfish_address_space_block shared;
+	unsigned long last_used; /* jiffies of the last write */
+	int keep; /* allocated for mmap(), never reclaimed */
+	int busy; /* used outside of image_mutex, by a source (filling it)
+		   * or a conversion (reading it) */
+	unsigned int stamp; /* changes whenever the frame is (re)written */
+	ktime_t written; /* when the frame was written */
+	/* V4L2LOOPBACK_SET_META of the frame; protected by the device's
+	 * lock */
+	struct v4l2_loopback_meta meta;
+};
+
+/* frame counters, of a device or of a single opener */
+struct v4l2l_stats {
+	u64 written; /* frames written */
+	u64 read; /* frames handed to readers */
+	u64 dropped; /* frames skipped by readers that fell behind */
+	u64 repeated; /* frames handed out again, for want of a new one */
+	u64 sustained; /* sustain_framerate timer ticks */
+	u64 timeouts; /* timeout images handed out */
+	u64 paced; /* frames dropped for coming faster than timeperframe */
+	u64 latency_frames; /* frames the latency was measured on */
+	u64 latency_total; /* write to dequeue, in us */
+	u64 latency_max;
 };
 
+/* a capture format that differs from the writer's; shared by all openers
+ * that negotiated it */
+struct v4l2l_yuv;
+struct v4l2l_conv {
+	struct list_head list;
+	int refcount; /* protected by image_mutex */
+	struct v4l2_pix_format pix_format; /* what the readers get */
+	unsigned long buffer_size;
+	/* serializes the conversions, and protects the members below */
+	struct mutex lock;
+	struct v4l2l_buffer frames[MAX_BUFFERS]; /* converted ring */
+	unsigned int stamps[MAX_BUFFERS]; /* stamp of the source frame */
+	DECLARE_BITMAP(valid, MAX_BUFFERS); /* frames[i] holds a conversion */
+	struct v4l2l_yuv *rows; /* scratch lines for the converter */
+	unsigned int rows_width;
+	u32 *sums; /* scratch line for scaling down */
+};
+
+/* an in-kernel writer, reading frames from a file */
+struct v4l2l_source {
+	struct file *file; /* of the opener that set the source */
+	struct file *src;
+	loff_t pos;
+	struct task_struct *task;
+	struct bio_vec *bvec; /* the frame being read */
+	unsigned int nr_bvec;
+};
+
+#ifdef V4L2LOOPBACK_WITH_FENCES
+/* explicit synchronization of a single buffer */
+struct v4l2l_fence {
+	struct v4l2_loopback_device *dev;
+	int index;
+	struct dma_fence *next; /* V4L2LOOPBACK_SET_IN_FENCE; protected by
+				 * the device's lock */
+	struct dma_fence *pending; /* queued frame waits for it */
+	struct dma_fence_cb cb;
+	struct work_struct work; /* hands out the frame once pending signals */
+};
+#endif
+
 struct v4l2_loopback_device {
 	struct v4l2_device v4l2_dev;
 	struct v4l2_ctrl_handler ctrl_handler;
-	struct video_device *vdev;
+	struct video_device *vdev; /* OUTPUT (and CAPTURE, unless split) */
+	struct video_device *vdev_cap; /* CAPTURE of split devices, or NULL */
 	/* pixel and stream format */
 	struct v4l2_pix_format pix_format;
 	bool pix_format_has_valid_sizeimage;
 	struct v4l2_captureparm capture_param;
 	unsigned long frame_jiffies;
+	int frame_node; /* a NUMA node, V4L2L_NODE_WRITER or _INTERLEAVE */
+	int writer_node; /* where the writer last ran, or NUMA_NO_NODE */
+	int last_node; /* where the last frame went, or NUMA_NO_NODE */
+	ktime_t pace_next; /* when pace_output lets the next frame through */
 
 	/* ctrls */
 	int keep_format; /* CID_KEEP_FORMAT; stay ready_for_capture even when all
@@ -304,8 +470,11 @@ struct v4l2_loopback_device {
 				  (close to) nominal framerate */
 
 	/* buffers stuff */
-	u8 *image; /* pointer to actual buffers data */
-	unsigned long int imagesize; /* size of buffers data */
+	unsigned long int imagesize; /* size of buffers data, 0 if the buffers
+				      * are not allocated */
+	struct mutex image_mutex; /* protects the frame memory of the buffers */
+	struct delayed_work reclaim_work; /* frees buffers that went unused */
+	struct list_head convs; /* struct v4l2l_conv; protected by image_mutex */
 	int buffers_number; /* should not be big, 4 is a good choice */
 	struct v4l2l_buffer buffers[MAX_BUFFERS]; /* inner driver buffers */
 	int used_buffers; /* number of the actually used buffers */
@@ -327,6 +496,7 @@ struct v4l2_loopback_device {
 	int timeout_image_io; /* CID_TIMEOUT_IMAGE_IO; next opener will
 			       * read/write to timeout_image */
 	u8 *timeout_image; /* copy of it will be captured when timeout passes */
+	struct page **timeout_image_pages; /* pages backing timeout_image */
 	struct v4l2l_buffer timeout_image_buffer;
 	struct timer_list timeout_timer;
 	int timeout_happened;
@@ -351,6 +521,21 @@ struct v4l2_loopback_device {
 
 	wait_queue_head_t read_event;
 	spinlock_t lock, list_lock;
+
+	/* statistics; protected by lock */
+	struct v4l2l_stats stats;
+	struct list_head openers;
+	struct dentry *debugfs;
+
+#ifdef V4L2LOOPBACK_WITH_FENCES
+	struct v4l2l_fence fences[MAX_BUFFERS];
+#endif
+};
+
+/* a V4L2_MEMORY_USERPTR buffer, as last queued */
+struct v4l2l_userptr {
+	unsigned long userptr;
+	u32 length;
 };
 
 /* types of opener shows what opener wants to do with loopback */
@@ -371,6 +556,25 @@ struct v4l2_loopback_opener {
 	struct v4l2_buffer *buffers;
 	int buffers_number; /* should not be big, 4 is a good choice */
 	int timeout_image_io;
+	struct v4l2l_conv *conv; /* NULL if reading the writer's format */
+	struct v4l2l_source *source; /* V4L2LOOPBACK_SET_SOURCE */
+	enum v4l2_memory memory; /* of the last VIDIOC_REQBUFS */
+	struct v4l2l_userptr userptr[MAX_BUFFERS];
+	/* queued CAPTURE USERPTR buffers, oldest first; protected by the
+	 * device's lock */
+	u8 userptr_queue[MAX_BUFFERS];
+	unsigned int userptr_head, userptr_count;
+	/* serializes VIDIOC_DQBUF of CAPTURE USERPTR buffers, so the head of
+	 * the queue stays put while its frame is copied */
+	struct mutex userptr_lock;
+	/* writers: for the next frame; readers: of the last frame handed
+	 * out; protected by the device's lock */
+	struct v4l2_loopback_meta meta;
+
+	/* statistics; protected by the device's lock */
+	struct v4l2l_stats stats;
+	s64 latency; /* of the last frame handed out, in us */
+	struct list_head list; /* in the device's openers */
 
 	struct v4l2_fh fh;
 };
@@ -437,6 +641,15 @@ static const struct v4l2l_format *format_by_fourcc(int fourcc)
 	return NULL;
 }
 
+/* whether the writer's frames are compressed, and thus of varying size */
+static bool v4l2l_is_compressed(struct v4l2_loopback_device *dev)
+{
+	const struct v4l2l_format *fmt =
+		format_by_fourcc(dev->pix_format.pixelformat);
+
+	return fmt && (fmt->flags & FORMAT_FLAGS_COMPRESSED);
+}
+
 static void pix_format_set_size(struct v4l2_pix_format *f,
 				const struct v4l2l_format *fmt,
 				unsigned int width, unsigned int height)
@@ -501,6 +714,13 @@ static int v4l2l_fill_format(struct v4l2_format *fmt, int capture,
 			return -EINVAL;
 		pix_format_set_size(&fmt0.fmt.pix, format, width, height);
 		fmt0.fmt.pix.pixelformat = format->fourcc;
+		/* the estimate for compressed formats is that of an
+		 * uncompressed frame; the writer knows better */
+		if ((format->flags & FORMAT_FLAGS_COMPRESSED) &&
+		    !V4L2_TYPE_IS_MULTIPLANAR(fmt0.type) &&
+		    fmt->fmt.pix.sizeimage >= PAGE_SIZE &&
+		    fmt->fmt.pix.sizeimage < fmt0.fmt.pix.sizeimage)
+			fmt0.fmt.pix.sizeimage = fmt->fmt.pix.sizeimage;
 	}
 
 	if (V4L2_TYPE_IS_MULTIPLANAR(fmt0.type)) {
@@ -583,6 +803,301 @@ static int pix_format_eq(const struct v4l2_pix_format *ref,
 	return result;
 }
 
+/* format conversion
+ * frames are converted a pair of lines at a time, going through full
+ * resolution YUV (BT.601, limited range); integer only, so that it can run
+ * in process context without kernel_fpu_begin() */
+struct v4l2l_yuv {
+	u8 y, u, v;
+};
+
+enum v4l2l_conv_layout {
+	V4L2L_PACKED_YUV, /* 4:2:2, two pixels in four bytes */
+	V4L2L_PLANAR_YUV, /* 4:2:0, three planes */
+	V4L2L_SEMIPLANAR_YUV, /* 4:2:0, Y plane + interleaved chroma plane */
+	V4L2L_GREY,
+	V4L2L_RGB,
+};
+
+struct v4l2l_conv_format {
+	u32 fourcc;
+	enum v4l2l_conv_layout layout;
+	u8 bpp; /* bytes per pixel of the (first) plane */
+	/* byte offsets of Y/Cb/Cr (packed), plane order of Cb/Cr (planar),
+	 * or byte offsets of R/G/B */
+	u8 c0, c1, c2;
+};
+
+static const struct v4l2l_conv_format conv_formats[] = {
+	// clang-format off
+	{ V4L2_PIX_FMT_YUYV,	V4L2L_PACKED_YUV,	2, 0, 1, 3 },
+	{ V4L2_PIX_FMT_UYVY,	V4L2L_PACKED_YUV,	2, 1, 0, 2 },
+#ifdef V4L2_PIX_FMT_YVYU
+	{ V4L2_PIX_FMT_YVYU,	V4L2L_PACKED_YUV,	2, 0, 3, 1 },
+#endif
+	{ V4L2_PIX_FMT_YUV420,	V4L2L_PLANAR_YUV,	1, 0, 0, 1 },
+	{ V4L2_PIX_FMT_YVU420,	V4L2L_PLANAR_YUV,	1, 0, 1, 0 },
+#ifdef V4L2_PIX_FMT_NV12
+	{ V4L2_PIX_FMT_NV12,	V4L2L_SEMIPLANAR_YUV,	1, 0, 0, 1 },
+#endif
+	{ V4L2_PIX_FMT_GREY,	V4L2L_GREY,		1, 0, 0, 0 },
+	{ V4L2_PIX_FMT_RGB24,	V4L2L_RGB,		3, 0, 1, 2 },
+	{ V4L2_PIX_FMT_BGR24,	V4L2L_RGB,		3, 2, 1, 0 },
+	{ V4L2_PIX_FMT_RGB32,	V4L2L_RGB,		4, 1, 2, 3 },
+	{ V4L2_PIX_FMT_BGR32,	V4L2L_RGB,		4, 2, 1, 0 },
+	// clang-format on
+};
+
+static const struct v4l2l_conv_format *conv_format_by_fourcc(u32 fourcc)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(conv_formats); i++) {
+		if (conv_formats[i].fourcc == fourcc)
+			return conv_formats + i;
+	}
+	return NULL;
+}
+
+/* whether frames in pix can be converted (from or to) */
+static const struct v4l2l_conv_format *
+v4l2l_conv_format(const struct v4l2_pix_format *pix)
+{
+	/* the chroma subsampling is done on 2x2 blocks */
+	if (!pix->width || !pix->height || (pix->width & 1) ||
+	    (pix->height & 1))
+		return NULL;
+	return conv_format_by_fourcc(pix->pixelformat);
+}
+
+/* finds the chroma planes of a (semi)planar frame */
+static void v4l2l_conv_chroma(const struct v4l2l_conv_format *cf,
+			      const struct v4l2_pix_format *pix, u8 *base,
+			      u8 **cb, u8 **cr, unsigned int *stride)
+{
+	u8 *plane = base + pix->bytesperline * pix->height;
+
+	if (cf->layout == V4L2L_SEMIPLANAR_YUV) {
+		*stride = pix->bytesperline;
+		*cb = plane + cf->c1;
+		*cr = plane + cf->c2;
+	} else {
+		*stride = pix->bytesperline / 2;
+		*cb = plane + cf->c1 * *stride * (pix->height / 2);
+		*cr = plane + cf->c2 * *stride * (pix->height / 2);
+	}
+}
+
+static inline u8 v4l2l_clamp8(int v)
+{
+	return clamp_t(int, v, 0, 255);
+}
+
+/* reads line row of the frame src into out[0..width) */
+static void v4l2l_unpack_line(const struct v4l2l_conv_format *cf,
+			      const struct v4l2_pix_format *pix,
+			      const u8 *src, unsigned int row,
+			      struct v4l2l_yuv *out)
+{
+	const u8 *line = src + row * pix->bytesperline;
+	unsigned int x, width = pix->width;
+	u8 *cb, *cr;
+	unsigned int stride, step;
+
+	switch (cf->layout) {
+	case V4L2L_PACKED_YUV:
+		for (x = 0; x < width; x += 2, line += 4) {
+			out[x].y = line[cf->c0];
+			out[x + 1].y = line[cf->c0 + 2];
+			out[x].u = out[x + 1].u = line[cf->c1];
+			out[x].v = out[x + 1].v = line[cf->c2];
+		}
+		break;
+	case V4L2L_PLANAR_YUV:
+	case V4L2L_SEMIPLANAR_YUV:
+		v4l2l_conv_chroma(cf, pix, (u8 *)src, &cb, &cr, &stride);
+		cb += (row / 2) * stride;
+		cr += (row / 2) * stride;
+		step = cf->layout == V4L2L_SEMIPLANAR_YUV ? 2 : 1;
+		for (x = 0; x < width; x += 2, cb += step, cr += step) {
+			out[x].y = line[x];
+			out[x + 1].y = line[x + 1];
+			out[x].u = out[x + 1].u = *cb;
+			out[x].v = out[x + 1].v = *cr;
+		}
+		break;
+	case V4L2L_GREY:
+		for (x = 0; x < width; x++) {
+			out[x].y = line[x];
+			out[x].u = out[x].v = 128;
+		}
+		break;
+	case V4L2L_RGB:
+		for (x = 0; x < width; x++, line += cf->bpp) {
+			int r = line[cf->c0], g = line[cf->c1],
+			    b = line[cf->c2];
+
+			out[x].y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+			out[x].u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) +
+				   128;
+			out[x].v = ((112 * r - 94 * g - 18 * b + 128) >> 8) +
+				   128;
+		}
+		break;
+	}
+}
+
+static void v4l2l_pack_rgb(const struct v4l2l_conv_format *cf, u8 *line,
+			   const struct v4l2l_yuv *in, unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; x++, line += cf->bpp) {
+		int c = 298 * (in[x].y - 16), d = in[x].u - 128,
+		    e = in[x].v - 128;
+
+		line[cf->c0] = v4l2l_clamp8((c + 409 * e + 128) >> 8);
+		line[cf->c1] = v4l2l_clamp8((c - 100 * d - 208 * e + 128) >> 8);
+		line[cf->c2] = v4l2l_clamp8((c + 516 * d + 128) >> 8);
+		if (cf->bpp == 4) /* the padding byte: first for xRGB */
+			line[cf->c0 == 1 ? 0 : 3] = 0xff;
+	}
+}
+
+/* writes lines row and row+1 (row being even) of the frame dst */
+static void v4l2l_pack_lines(const struct v4l2l_conv_format *cf,
+			     const struct v4l2_pix_format *pix, u8 *dst,
+			     unsigned int row, const struct v4l2l_yuv *in0,
+			     const struct v4l2l_yuv *in1)
+{
+	u8 *line0 = dst + row * pix->bytesperline;
+	u8 *line1 = line0 + pix->bytesperline;
+	unsigned int x, width = pix->width;
+	u8 *cb, *cr;
+	unsigned int stride, step;
+
+	switch (cf->layout) {
+	case V4L2L_PACKED_YUV:
+		for (x = 0; x < width; x += 2, line0 += 4, line1 += 4) {
+			line0[cf->c0] = in0[x].y;
+			line0[cf->c0 + 2] = in0[x + 1].y;
+			line0[cf->c1] = (in0[x].u + in0[x + 1].u + 1) >> 1;
+			line0[cf->c2] = (in0[x].v + in0[x + 1].v + 1) >> 1;
+			line1[cf->c0] = in1[x].y;
+			line1[cf->c0 + 2] = in1[x + 1].y;
+			line1[cf->c1] = (in1[x].u + in1[x + 1].u + 1) >> 1;
+			line1[cf->c2] = (in1[x].v + in1[x + 1].v + 1) >> 1;
+		}
+		break;
+	case V4L2L_PLANAR_YUV:
+	case V4L2L_SEMIPLANAR_YUV:
+		v4l2l_conv_chroma(cf, pix, dst, &cb, &cr, &stride);
+		cb += (row / 2) * stride;
+		cr += (row / 2) * stride;
+		step = cf->layout == V4L2L_SEMIPLANAR_YUV ? 2 : 1;
+		for (x = 0; x < width; x += 2, cb += step, cr += step) {
+			line0[x] = in0[x].y;
+			line0[x + 1] = in0[x + 1].y;
+			line1[x] = in1[x].y;
+			line1[x + 1] = in1[x + 1].y;
+			*cb = (in0[x].u + in0[x + 1].u + in1[x].u +
+			       in1[x + 1].u + 2) >> 2;
+			*cr = (in0[x].v + in0[x + 1].v + in1[x].v +
+			       in1[x + 1].v + 2) >> 2;
+		}
+		break;
+	case V4L2L_GREY:
+		for (x = 0; x < width; x++) {
+			line0[x] = in0[x].y;
+			line1[x] = in1[x].y;
+		}
+		break;
+	case V4L2L_RGB:
+		v4l2l_pack_rgb(cf, line0, in0, width);
+		v4l2l_pack_rgb(cf, line1, in1, width);
+		break;
+	}
+}
+
+/* reads line row of the scaled down frame: the average of the source
+ * pixels it covers (a box filter)
+ * line holds one source line, sums 3 * width */
+static void v4l2l_unpack_box_line(const struct v4l2l_conv_format *cf,
+				  const struct v4l2_pix_format *pix,
+				  const u8 *src, unsigned int row,
+				  unsigned int width, unsigned int height,
+				  struct v4l2l_yuv *line, u32 *sums,
+				  struct v4l2l_yuv *out)
+{
+	unsigned int y0 = row * pix->height / height;
+	unsigned int y1 = (row + 1) * pix->height / height;
+	unsigned int x, sx, end, n, y;
+
+	memset(sums, 0, 3 * width * sizeof(*sums));
+	for (y = y0; y < y1; y++) {
+		v4l2l_unpack_line(cf, pix, src, y, line);
+		for (x = 0, sx = 0; x < width; x++) {
+			u32 sy = 0, su = 0, sv = 0;
+
+			end = (x + 1) * pix->width / width;
+			n = end - sx;
+			for (; sx < end; sx++) {
+				sy += line[sx].y;
+				su += line[sx].u;
+				sv += line[sx].v;
+			}
+			sums[3 * x] += (sy + n / 2) / n;
+			sums[3 * x + 1] += (su + n / 2) / n;
+			sums[3 * x + 2] += (sv + n / 2) / n;
+		}
+	}
+
+	n = y1 - y0;
+	for (x = 0; x < width; x++) {
+		out[x].y = (sums[3 * x] + n / 2) / n;
+		out[x].u = (sums[3 * x + 1] + n / 2) / n;
+		out[x].v = (sums[3 * x + 2] + n / 2) / n;
+	}
+}
+
+/* converts the frame src (described by spix) into dst (dpix); both must
+ * have passed v4l2l_conv_format(), and dst may be smaller than src
+ * rows must hold three lines of spix->width pixels; sums (only needed when
+ * scaling) 3 * dpix->width values */
+static void v4l2l_convert_frame(const struct v4l2_pix_format *spix,
+				const u8 *src,
+				const struct v4l2_pix_format *dpix, u8 *dst,
+				struct v4l2l_yuv *rows, u32 *sums)
+{
+	const struct v4l2l_conv_format *sf = v4l2l_conv_format(spix);
+	const struct v4l2l_conv_format *df = v4l2l_conv_format(dpix);
+	unsigned int row, width = dpix->width, height = dpix->height;
+	struct v4l2l_yuv *row0, *row1;
+
+	if (spix->width == width && spix->height == height) {
+		row0 = rows;
+		row1 = rows + spix->width;
+		for (row = 0; row < height; row += 2) {
+			v4l2l_unpack_line(sf, spix, src, row, row0);
+			v4l2l_unpack_line(sf, spix, src, row + 1, row1);
+			v4l2l_pack_lines(df, dpix, dst, row, row0, row1);
+			cond_resched();
+		}
+		return;
+	}
+
+	row0 = rows + spix->width;
+	row1 = row0 + width;
+	for (row = 0; row < height; row += 2) {
+		v4l2l_unpack_box_line(sf, spix, src, row, width, height, rows,
+				      sums, row0);
+		v4l2l_unpack_box_line(sf, spix, src, row + 1, width, height,
+				      rows, sums, row1);
+		v4l2l_pack_lines(df, dpix, dst, row, row0, row1);
+		cond_resched();
+	}
+}
+
 static struct v4l2_loopback_device *v4l2loopback_getdevice(struct file *f);
 static int inner_try_setfmt(struct file *file, struct v4l2_format *fmt)
 {
@@ -741,6 +1256,73 @@ static ssize_t attr_store_maxopeners(struct device *cd,
 static DEVICE_ATTR(max_openers, S_IRUGO | S_IWUSR, attr_show_maxopeners,
 		   attr_store_maxopeners);
 
+static bool v4l2l_valid_frame_node(int node)
+{
+	if (node < 0)
+		return node == V4L2L_NODE_WRITER || node == V4L2L_NODE_INTERLEAVE;
+	return node < MAX_NUMNODES && node_online(node);
+}
+
+/* the NUMA policy of the frame memory ("writer", "interleave" or a node) */
+static ssize_t attr_show_frame_node(struct device *cd,
+				    struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+	int node;
+
+	if (!dev)
+		return -ENODEV;
+
+	node = READ_ONCE(dev->frame_node);
+	if (node == V4L2L_NODE_WRITER)
+		return sysfs_emit(buf, "writer\n");
+	if (node == V4L2L_NODE_INTERLEAVE)
+		return sysfs_emit(buf, "interleave\n");
+	return sysfs_emit(buf, "%d\n", node);
+}
+
+/* takes effect for frames allocated from now on */
+static ssize_t attr_store_frame_node(struct device *cd,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+	int node;
+
+	if (!dev)
+		return -ENODEV;
+
+	if (sysfs_streq(buf, "writer"))
+		node = V4L2L_NODE_WRITER;
+	else if (sysfs_streq(buf, "interleave"))
+		node = V4L2L_NODE_INTERLEAVE;
+	else if (kstrtoint(buf, 0, &node))
+		return -EINVAL;
+	if (!v4l2l_valid_frame_node(node))
+		return -EINVAL;
+
+	WRITE_ONCE(dev->frame_node, node);
+	return len;
+}
+
+static DEVICE_ATTR(frame_node, S_IRUGO | S_IWUSR, attr_show_frame_node,
+		   attr_store_frame_node);
+
+/* the node the last frame was allocated on (-1 if none yet) */
+static ssize_t attr_show_frame_node_used(struct device *cd,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+
+	if (!dev)
+		return -ENODEV;
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(dev->last_node));
+}
+
+static DEVICE_ATTR(frame_node_used, S_IRUGO, attr_show_frame_node_used, NULL);
+
 static ssize_t attr_show_state(struct device *cd, struct device_attribute *attr,
 			       char *buf)
 {
@@ -759,6 +1341,73 @@ static ssize_t attr_show_state(struct device *cd, struct device_attribute *attr,
 
 static DEVICE_ATTR(state, S_IRUGO, attr_show_state, NULL);
 
+static u64 v4l2l_latency_avg(const struct v4l2l_stats *st)
+{
+	return st->latency_frames ?
+		       div64_u64(st->latency_total, st->latency_frames) :
+		       0;
+}
+
+static int v4l2l_print_stats(char *buf, size_t size,
+			     const struct v4l2l_stats *st)
+{
+	return scnprintf(buf, size,
+			 "written %llu\nread %llu\ndropped %llu\nrepeated %llu\n"
+			 "sustained %llu\ntimeouts %llu\npaced %llu\n"
+			 "latency_avg_us %llu\nlatency_max_us %llu\n",
+			 st->written, st->read, st->dropped, st->repeated,
+			 st->sustained, st->timeouts, st->paced,
+			 v4l2l_latency_avg(st), st->latency_max);
+}
+
+/* stats/<counter>: one file per counter of the device
+ * (the counters of each opener are in debugfs) */
+#define V4L2L_STATS_ATTR(name, value)                                          \
+	static ssize_t attr_show_stats_##name(struct device *cd,               \
+					      struct device_attribute *attr,   \
+					      char *buf)                       \
+	{                                                                      \
+		struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);    \
+		struct v4l2l_stats st;                                         \
+                                                                               \
+		if (!dev)                                                      \
+			return -ENODEV;                                        \
+		spin_lock_bh(&dev->lock);                                      \
+		st = dev->stats;                                               \
+		spin_unlock_bh(&dev->lock);                                    \
+		return sysfs_emit(buf, "%llu\n", (value));                     \
+	}                                                                      \
+	static struct device_attribute dev_attr_stats_##name =                 \
+		__ATTR(name, S_IRUGO, attr_show_stats_##name, NULL)
+
+V4L2L_STATS_ATTR(written, st.written);
+V4L2L_STATS_ATTR(read, st.read);
+V4L2L_STATS_ATTR(dropped, st.dropped);
+V4L2L_STATS_ATTR(repeated, st.repeated);
+V4L2L_STATS_ATTR(sustained, st.sustained);
+V4L2L_STATS_ATTR(timeouts, st.timeouts);
+V4L2L_STATS_ATTR(paced, st.paced);
+V4L2L_STATS_ATTR(latency_avg_us, v4l2l_latency_avg(&st));
+V4L2L_STATS_ATTR(latency_max_us, st.latency_max);
+
+static struct attribute *v4l2l_stats_attrs[] = {
+	&dev_attr_stats_written.attr,
+	&dev_attr_stats_read.attr,
+	&dev_attr_stats_dropped.attr,
+	&dev_attr_stats_repeated.attr,
+	&dev_attr_stats_sustained.attr,
+	&dev_attr_stats_timeouts.attr,
+	&dev_attr_stats_paced.attr,
+	&dev_attr_stats_latency_avg_us.attr,
+	&dev_attr_stats_latency_max_us.attr,
+	NULL,
+};
+
+static const struct attribute_group v4l2l_stats_group = {
+	.name = "stats",
+	.attrs = v4l2l_stats_attrs,
+};
+
 static void v4l2loopback_remove_sysfs(struct video_device *vdev)
 {
 #define V4L2_SYSFS_DESTROY(x) device_remove_file(&vdev->dev, &dev_attr_##x)
@@ -768,6 +1417,9 @@ static void v4l2loopback_remove_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_DESTROY(buffers);
 		V4L2_SYSFS_DESTROY(max_openers);
 		V4L2_SYSFS_DESTROY(state);
+		sysfs_remove_group(&vdev->dev.kobj, &v4l2l_stats_group);
+		V4L2_SYSFS_DESTROY(frame_node);
+		V4L2_SYSFS_DESTROY(frame_node_used);
 		/* ... */
 	}
 }
@@ -787,6 +1439,11 @@ static void v4l2loopback_create_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_CREATE(buffers);
 		V4L2_SYSFS_CREATE(max_openers);
 		V4L2_SYSFS_CREATE(state);
+		res = sysfs_create_group(&vdev->dev.kobj, &v4l2l_stats_group);
+		if (res < 0)
+			break;
+		V4L2_SYSFS_CREATE(frame_node);
+		V4L2_SYSFS_CREATE(frame_node_used);
 		/* ... */
 	} while (0);
 
@@ -795,6 +1452,47 @@ static void v4l2loopback_create_sysfs(struct video_device *vdev)
 	dev_err(&vdev->dev, "%s error: %d\n", __func__, res);
 }
 
+/* debugfs: <debugfs>/v4l2loopback/videoN holds the counters of the device,
+ * followed by those of each opener */
+static struct dentry *v4l2loopback_debugfs_root;
+
+static int v4l2l_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct v4l2_loopback_device *dev = s->private;
+	struct v4l2_loopback_opener *opener;
+	char buf[384];
+	int i = 0;
+
+	spin_lock_bh(&dev->lock);
+	v4l2l_print_stats(buf, sizeof(buf), &dev->stats);
+	seq_puts(s, buf);
+	list_for_each_entry(opener, &dev->openers, list) {
+		seq_printf(s, "\nopener %d (%s):\n", i++,
+			   opener->type == READER ? "reader" :
+			   opener->type == WRITER ? "writer" :
+						    "unnegotiated");
+		v4l2l_print_stats(buf, sizeof(buf), &opener->stats);
+		seq_puts(s, buf);
+	}
+	spin_unlock_bh(&dev->lock);
+	return 0;
+}
+
+static int v4l2l_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, v4l2l_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations v4l2l_debugfs_fops = {
+	// clang-format off
+	.owner		= THIS_MODULE,
+	.open		= v4l2l_debugfs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	// clang-format on
+};
+
 /* Event APIs */
 
 #define V4L2LOOPBACK_EVENT_BASE (V4L2_EVENT_PRIVATE_START)
@@ -807,64 +1505,68 @@ struct v4l2_event_client_usage {
 };
 
 /* global module data */
-/* find a device based on it's device-number (e.g. '3' for /dev/video3) */
-struct v4l2loopback_lookup_cb_data {
-	int device_nr;
-	struct v4l2_loopback_device *device;
-};
-static int v4l2loopback_lookup_cb(int id, void *ptr, void *data)
-{
-	struct v4l2_loopback_device *device = ptr;
-	struct v4l2loopback_lookup_cb_data *cbdata = data;
-	if (cbdata && device && device->vdev) {
-		if (device->vdev->num == cbdata->device_nr) {
-			cbdata->device = device;
-			cbdata->device_nr = id;
-			return 1;
-		}
-	}
-	return 0;
-}
+/* find a device based on it's device-number (e.g. '3' for /dev/video3)
+ * returns the device's index; call with v4l2loopback_ctl_mutex held */
 static int v4l2loopback_lookup(int device_nr,
 			       struct v4l2_loopback_device **device)
 {
-	struct v4l2loopback_lookup_cb_data data = {
-		.device_nr = device_nr,
-		.device = NULL,
-	};
-	int err = idr_for_each(&v4l2loopback_index_idr, &v4l2loopback_lookup_cb,
-			       &data);
-	if (1 == err) {
-		if (device)
-			*device = data.device;
-		return data.device_nr;
-	}
-	return -ENODEV;
+	struct v4l2_loopback_device *dev;
+
+	if (device_nr < 0)
+		return -ENODEV;
+	dev = idr_find(&v4l2loopback_vdevnr_idr, device_nr);
+	if (!dev || !dev->vdev)
+		return -ENODEV;
+	if (device)
+		*device = dev;
+	return ((struct v4l2loopback_private *)video_get_drvdata(dev->vdev))
+		->device_nr;
 }
 static struct v4l2_loopback_device *v4l2loopback_cd2dev(struct device *cd)
 {
 	struct video_device *loopdev = to_video_device(cd);
 	struct v4l2loopback_private *ptr =
 		(struct v4l2loopback_private *)video_get_drvdata(loopdev);
-	int nr = ptr->device_nr;
 
-	return idr_find(&v4l2loopback_index_idr, nr);
+	return ptr->dev;
 }
 
+/* the device is not looked up in v4l2loopback_index_idr: its slot is only
+ * filled once all nodes are registered, and emptied before they are
+ * unregistered, while the nodes can be opened all along */
 static struct v4l2_loopback_device *v4l2loopback_getdevice(struct file *f)
 {
 	struct v4l2loopback_private *ptr = video_drvdata(f);
-	int nr = ptr->device_nr;
 
-	return idr_find(&v4l2loopback_index_idr, nr);
+	return ptr->dev;
 }
 
 /* forward declarations */
 static void client_usage_queue_event(struct video_device *vdev);
+static void client_usage_queue_events(struct v4l2_loopback_device *dev);
+static void frame_sync_queue_events(struct v4l2_loopback_device *dev,
+				    u32 sequence);
+static void source_change_queue_events(struct v4l2_loopback_device *dev,
+				       const struct v4l2_pix_format *old);
 static void init_buffers(struct v4l2_loopback_device *dev);
 static int allocate_buffers(struct v4l2_loopback_device *dev);
+static int v4l2l_get_frame(struct v4l2_loopback_device *dev,
+			   struct v4l2l_buffer *buf, unsigned long size);
 static void free_buffers(struct v4l2_loopback_device *dev);
+static void v4l2_loopback_release(struct v4l2_device *v4l2_dev);
+static void v4l2_loopback_remove(struct v4l2_loopback_device *dev);
+static int v4l2l_alloc_frame(struct v4l2l_buffer *buf, unsigned long size,
+			     int node);
+static struct v4l2l_conv *v4l2l_get_conv(struct v4l2_loopback_device *dev,
+					 const struct v4l2_pix_format *pix);
+static void v4l2l_put_conv(struct v4l2_loopback_device *dev,
+			   struct v4l2l_conv *conv);
+static u8 *v4l2l_conv_frame(struct v4l2_loopback_device *dev,
+			    struct v4l2l_conv *conv, int index);
 static void try_free_buffers(struct v4l2_loopback_device *dev);
+static long v4l2l_set_source(struct file *file, void *fh,
+			     struct v4l2_loopback_source *arg);
+static void v4l2l_stop_source(struct v4l2l_source *src);
 static int allocate_timeout_image(struct v4l2_loopback_device *dev);
 static void check_timers(struct v4l2_loopback_device *dev);
 static const struct v4l2_file_operations v4l2_loopback_fops;
@@ -898,8 +1600,9 @@ static int vidioc_querycap(struct file *file, void *priv,
 			   struct v4l2_capability *cap)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct video_device *vdev = video_devdata(file);
 	int device_nr =
-		((struct v4l2loopback_private *)video_get_drvdata(dev->vdev))
+		((struct v4l2loopback_private *)video_get_drvdata(vdev))
 			->device_nr;
 	__u32 capabilities = V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
 
@@ -908,7 +1611,11 @@ static int vidioc_querycap(struct file *file, void *priv,
 	snprintf(cap->bus_info, sizeof(cap->bus_info),
 		 "platform:v4l2loopback-%03d", device_nr);
 
-	if (dev->announce_all_caps) {
+	if (vdev->vfl_dir == VFL_DIR_TX) {
+		capabilities |= V4L2_CAP_VIDEO_OUTPUT;
+	} else if (vdev->vfl_dir == VFL_DIR_RX) {
+		capabilities |= V4L2_CAP_VIDEO_CAPTURE;
+	} else if (dev->announce_all_caps) {
 		capabilities |= V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_OUTPUT;
 	} else {
 		if (dev->ready_for_capture) {
@@ -920,7 +1627,7 @@ static int vidioc_querycap(struct file *file, void *priv,
 	}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
-	dev->vdev->device_caps =
+	vdev->device_caps =
 #endif /* >=linux-4.7.0 */
 		cap->device_caps = cap->capabilities = capabilities;
 
@@ -930,28 +1637,57 @@ static int vidioc_querycap(struct file *file, void *priv,
 	return 0;
 }
 
+/* whether readers can get frames of the given format and size, by having
+ * the writer's ones converted and/or scaled down */
+static bool v4l2l_can_conv(struct v4l2_loopback_device *dev, __u32 fourcc,
+			   __u32 width, __u32 height)
+{
+	const struct v4l2_pix_format *src = &dev->pix_format;
+
+	return convert_formats && V4L2LOOPBACK_IS_FIXED_FMT(dev) &&
+	       v4l2l_conv_format(src) && conv_format_by_fourcc(fourcc) &&
+	       width && height && !(width & 1) && !(height & 1) &&
+	       width <= src->width && height <= src->height;
+}
+
 static int vidioc_enum_framesizes(struct file *file, void *fh,
 				  struct v4l2_frmsizeenum *argp)
 {
 	struct v4l2_loopback_device *dev;
 
-	/* there can be only one... */
-	if (argp->index)
-		return -EINVAL;
-
 	dev = v4l2loopback_getdevice(file);
 	if (V4L2LOOPBACK_IS_FIXED_FMT(dev)) {
 		/* format has already been negotiated
-		 * cannot change during runtime
+		 * cannot change during runtime; but readers may get it scaled
+		 * down (by powers of two here, any smaller size on S_FMT)
 		 */
-		if (argp->pixel_format != dev->pix_format.pixelformat)
+		__u32 width = dev->pix_format.width >> argp->index;
+		__u32 height = dev->pix_format.height >> argp->index;
+
+		if (argp->index) {
+			width &= ~1;
+			height &= ~1;
+			if (argp->index >= 8 ||
+			    width < V4L2LOOPBACK_SIZE_MIN_WIDTH ||
+			    height < V4L2LOOPBACK_SIZE_MIN_HEIGHT ||
+			    !v4l2l_can_conv(dev, argp->pixel_format, width,
+					    height))
+				return -EINVAL;
+		} else if (argp->pixel_format != dev->pix_format.pixelformat &&
+			   !v4l2l_can_conv(dev, argp->pixel_format, width,
+					   height)) {
 			return -EINVAL;
+		}
 
 		argp->type = V4L2_FRMSIZE_TYPE_DISCRETE;
 
-		argp->discrete.width = dev->pix_format.width;
-		argp->discrete.height = dev->pix_format.height;
+		argp->discrete.width = width;
+		argp->discrete.height = height;
 	} else {
+		/* there can be only one... */
+		if (argp->index)
+			return -EINVAL;
+
 		/* if the format has not been negotiated yet, we accept anything
 		 */
 		if (NULL == format_by_fourcc(argp->pixel_format))
@@ -992,9 +1728,11 @@ static int vidioc_enum_frameintervals(struct file *file, void *fh,
 		return -EINVAL;
 
 	if (V4L2LOOPBACK_IS_FIXED_FMT(dev)) {
-		if (argp->width != dev->pix_format.width ||
-		    argp->height != dev->pix_format.height ||
-		    argp->pixel_format != dev->pix_format.pixelformat)
+		if ((argp->width != dev->pix_format.width ||
+		     argp->height != dev->pix_format.height ||
+		     argp->pixel_format != dev->pix_format.pixelformat) &&
+		    !v4l2l_can_conv(dev, argp->pixel_format, argp->width,
+				    argp->height))
 			return -EINVAL;
 
 		argp->type = V4L2_FRMIVAL_TYPE_DISCRETE;
@@ -1021,6 +1759,81 @@ static int vidioc_enum_frameintervals(struct file *file, void *fh,
 
 /* ------------------ CAPTURE ----------------------- */
 
+/* returns the index'th capture format other than the writer's one that
+ * frames can be converted to, 0 if there is none */
+static __u32 v4l2l_enum_conv_format(struct v4l2_loopback_device *dev,
+				    __u32 index)
+{
+	unsigned int i;
+
+	if (!convert_formats || !v4l2l_conv_format(&dev->pix_format))
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(conv_formats); i++) {
+		if (conv_formats[i].fourcc == dev->pix_format.pixelformat)
+			continue;
+		if (--index == 0)
+			return conv_formats[i].fourcc;
+	}
+	return 0;
+}
+
+/* checks whether the capture format fmt can be served by converting (or
+ * scaling down) the writer's frames, and fills in the rest of it if so */
+static int v4l2l_try_conv_format(struct v4l2_loopback_device *dev,
+				 struct v4l2_format *fmt)
+{
+	const struct v4l2_pix_format *src = &dev->pix_format;
+	__u32 width = fmt->fmt.pix.width, height = fmt->fmt.pix.height;
+
+	/* anything larger gets the full size, odd sizes are rounded down */
+	if (!width || width > src->width)
+		width = src->width;
+	if (!height || height > src->height)
+		height = src->height;
+	width = max_t(__u32, width & ~1, 2);
+	height = max_t(__u32, height & ~1, 2);
+
+	if (fmt->fmt.pix.pixelformat == src->pixelformat &&
+	    width == src->width && height == src->height)
+		return -EINVAL;
+	if (!v4l2l_can_conv(dev, fmt->fmt.pix.pixelformat, width, height))
+		return -EINVAL;
+
+	fmt->fmt.pix.bytesperline = 0;
+	fmt->fmt.pix.sizeimage = 0;
+	if (v4l2l_fill_format(fmt, 1, width, width, height, height) != 0)
+		return -EINVAL;
+	fmt->fmt.pix.colorspace = src->colorspace;
+	return 0;
+}
+
+/* makes the opener read frames in the format pix (NULL: the writer's) */
+static int v4l2l_set_conv(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener,
+			  const struct v4l2_pix_format *pix)
+{
+	struct v4l2l_conv *conv = NULL;
+
+	if (opener->conv == NULL && pix == NULL)
+		return 0;
+	if (opener->type == READER)
+		return -EBUSY;
+
+	mutex_lock(&dev->image_mutex);
+	if (pix) {
+		conv = v4l2l_get_conv(dev, pix);
+		if (IS_ERR(conv)) {
+			mutex_unlock(&dev->image_mutex);
+			return PTR_ERR(conv);
+		}
+	}
+	if (opener->conv)
+		v4l2l_put_conv(dev, opener->conv);
+	opener->conv = conv;
+	mutex_unlock(&dev->image_mutex);
+	return 0;
+}
+
 /* returns device formats
  * called on VIDIOC_ENUM_FMT, with v4l2_buf_type set to V4L2_BUF_TYPE_VIDEO_CAPTURE
  */
@@ -1033,12 +1846,16 @@ static int vidioc_enum_fmt_cap(struct file *file, void *fh,
 
 	dev = v4l2loopback_getdevice(file);
 
-	if (f->index)
-		return -EINVAL;
-
 	if (V4L2LOOPBACK_IS_FIXED_FMT(dev)) {
-		/* format has been fixed, so only one single format is supported */
-		const __u32 format = dev->pix_format.pixelformat;
+		/* format has been fixed, so only the writer's format is
+		 * supported, plus what it can be converted to */
+		__u32 format = dev->pix_format.pixelformat;
+
+		if (f->index) {
+			format = v4l2l_enum_conv_format(dev, f->index);
+			if (!format)
+				return -EINVAL;
+		}
 
 		if ((fmt = format_by_fourcc(format))) {
 			snprintf(f->description, sizeof(f->description), "%s",
@@ -1050,7 +1867,7 @@ static int vidioc_enum_fmt_cap(struct file *file, void *fh,
 				 (format >> 24) & 0xFF);
 		}
 
-		f->pixelformat = dev->pix_format.pixelformat;
+		f->pixelformat = format;
 	} else {
 		return -EINVAL;
 	}
@@ -1072,7 +1889,10 @@ static int vidioc_g_fmt_cap(struct file *file, void *priv,
 	if (!dev->ready_for_capture && !dev->ready_for_output)
 		return -EINVAL;
 
-	fmt->fmt.pix = dev->pix_format;
+	if (fh_to_opener(priv)->conv)
+		fmt->fmt.pix = fh_to_opener(priv)->conv->pix_format;
+	else
+		fmt->fmt.pix = dev->pix_format;
 	MARK();
 	return 0;
 }
@@ -1089,6 +1909,8 @@ static int vidioc_try_fmt_cap(struct file *file, void *priv,
 	int ret = 0;
 	if (!V4L2_TYPE_IS_CAPTURE(fmt->type))
 		return -EINVAL;
+	if (!v4l2l_try_conv_format(v4l2loopback_getdevice(file), fmt))
+		return 0;
 	ret = inner_try_setfmt(file, fmt);
 	if (-EBUSY == ret)
 		return 0;
@@ -1105,11 +1927,18 @@ static int vidioc_s_fmt_cap(struct file *file, void *priv,
 {
 	int ret;
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(priv);
 	if (!V4L2_TYPE_IS_CAPTURE(fmt->type))
 		return -EINVAL;
+	if (!v4l2l_try_conv_format(dev, fmt))
+		return v4l2l_set_conv(dev, opener, &fmt->fmt.pix);
 	ret = inner_try_setfmt(file, fmt);
 	if (!ret) {
+		struct v4l2_pix_format old = dev->pix_format;
+
 		dev->pix_format = fmt->fmt.pix;
+		source_change_queue_events(dev, &old);
+		ret = v4l2l_set_conv(dev, opener, NULL);
 	}
 	return ret;
 }
@@ -1223,9 +2052,14 @@ static int vidioc_s_fmt_out(struct file *file, void *priv,
 
 	ret = inner_try_setfmt(file, fmt);
 	if (!ret) {
+		struct v4l2_pix_format old = dev->pix_format;
+
 		dev->pix_format = fmt->fmt.pix;
 		dev->pix_format_has_valid_sizeimage =
 			v4l2l_pix_format_has_valid_sizeimage(fmt);
+		source_change_queue_events(dev, &old);
+		/* the frames are allocated right below, or on REQBUFS */
+		WRITE_ONCE(dev->writer_node, numa_node_id());
 		dprintk("s_fmt_out(%d) %d...%d\n", ret, dev->ready_for_capture,
 			dev->pix_format.sizeimage);
 		dprintk("outFOURCC=%s\n",
@@ -1535,7 +2369,7 @@ static int vidioc_s_input(struct file *file, void *fh, unsigned int i)
 /* --------------- V4L2 ioctl buffer related calls ----------------- */
 
 /* negotiate buffer type
- * only mmap streaming supported
+ * mmap and userptr streaming supported
  * called on VIDIOC_REQBUFS
  */
 static int vidioc_reqbufs(struct file *file, void *fh,
@@ -1543,8 +2377,9 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 {
 	struct v4l2_loopback_device *dev;
 	struct v4l2_loopback_opener *opener;
-	unsigned int i;
+	unsigned int i, mapped;
 	unsigned long long num;
+	int ret = 0;
 	MARK();
 
 	dev = v4l2loopback_getdevice(file);
@@ -1568,10 +2403,60 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	init_buffers(dev);
 	switch (b->memory) {
 	case V4L2_MEMORY_MMAP:
-		/* do nothing here, buffers are always allocated */
+	case V4L2_MEMORY_USERPTR:
+		/* not while VIDIOC_DQBUF copies to a queued USERPTR buffer */
+		if (mutex_lock_interruptible(&opener->userptr_lock))
+			return -ERESTARTSYS;
+		spin_lock_bh(&dev->lock);
+		opener->memory = b->memory;
+		opener->userptr_head = opener->userptr_count = 0;
+		spin_unlock_bh(&dev->lock);
+		mutex_unlock(&opener->userptr_lock);
 		if (b->count < 1 || dev->buffers_number < 1)
 			return 0;
 
+		/* buffers are usually set up by now; if they have been
+		 * freed in the meantime, get them back before anybody mmap()s */
+		if (!dev->imagesize) {
+			ret = allocate_buffers(dev);
+			if (ret < 0)
+				return ret;
+		}
+
+		/* mmap()ed frames must exist up front, and stay around;
+		 * userptr frames are copied on QBUF/DQBUF */
+		if (mutex_lock_interruptible(&dev->image_mutex))
+			return -ERESTARTSYS;
+		mapped = b->memory == V4L2_MEMORY_MMAP ? dev->buffers_number : 0;
+		for (i = 0; i < mapped; ++i) {
+			ret = v4l2l_get_frame(dev, &dev->buffers[i],
+					      dev->buffer_size);
+			if (ret < 0)
+				break;
+			dev->buffers[i].keep = 1;
+		}
+		mutex_unlock(&dev->image_mutex);
+		if (ret < 0)
+			return ret;
+		/* a converting reader maps the converted frames instead */
+		if (opener->conv && mapped) {
+			mutex_lock(&opener->conv->lock);
+			for (i = 0; ret >= 0 && i < mapped; ++i) {
+				struct v4l2l_buffer *frame =
+					&opener->conv->frames[i];
+
+				if (frame->data == NULL)
+					ret = v4l2l_alloc_frame(
+						frame,
+						opener->conv->buffer_size,
+						NUMA_NO_NODE);
+				frame->keep = 1;
+			}
+			mutex_unlock(&opener->conv->lock);
+			if (ret < 0)
+				return ret;
+		}
+
 		if (b->count > dev->buffers_number)
 			b->count = dev->buffers_number;
 
@@ -1652,6 +2537,18 @@ static int vidioc_querybuf(struct file *file, void *fh, struct v4l2_buffer *b)
 
 	b->type = type;
 	b->index = index;
+	if (opener->conv && !opener->timeout_image_io &&
+	    V4L2_TYPE_IS_CAPTURE(type)) {
+		b->bytesused = opener->conv->pix_format.sizeimage;
+		b->length = opener->conv->buffer_size;
+		b->m.offset = index * opener->conv->buffer_size;
+	}
+	if (opener->memory == V4L2_MEMORY_USERPTR &&
+	    !opener->timeout_image_io) {
+		b->memory = V4L2_MEMORY_USERPTR;
+		b->m.userptr = opener->userptr[index].userptr;
+		b->length = opener->userptr[index].length;
+	}
 	dprintkrw("buffer type: %d (of %d with size=%ld)\n", b->memory,
 		  dev->buffers_number, dev->buffer_size);
 
@@ -1668,9 +2565,14 @@ static void buffer_written(struct v4l2_loopback_device *dev,
 {
 	unsigned int index;
 	unsigned long long temp;
+	u32 sequence;
 	del_timer_sync(&dev->sustain_timer);
 	del_timer_sync(&dev->timeout_timer);
 
+	buf->last_used = jiffies;
+	buf->stamp++;
+	buf->written = ktime_get();
+
 	spin_lock_bh(&dev->list_lock);
 	list_move_tail(&buf->list_head, &dev->outbufs_list);
 	spin_unlock_bh(&dev->list_lock);
@@ -1680,11 +2582,406 @@ static void buffer_written(struct v4l2_loopback_device *dev,
 	temp = dev->write_position;
 	index = do_div(temp, dev->used_buffers);
 	dev->bufpos2index[index] = buf->buffer.index;
-	++dev->write_position;
+	sequence = dev->write_position++;
 	dev->reread_count = 0;
+	dev->stats.written++;
 
 	check_timers(dev);
 	spin_unlock_bh(&dev->lock);
+
+	frame_sync_queue_events(dev, sequence);
+}
+
+/* whether a frame written now keeps to the nominal frame rate, with
+ * pace_output; frames a little early are let through, so that jitter
+ * doesn't cost frames */
+static bool v4l2l_pace(struct v4l2_loopback_device *dev)
+{
+	const struct v4l2_fract *tpf = &dev->capture_param.timeperframe;
+	ktime_t now = ktime_get();
+	bool ok = true;
+	u64 interval;
+
+	if (!pace_output)
+		return true;
+	interval = div_u64((u64)tpf->numerator * NSEC_PER_SEC,
+			   tpf->denominator);
+
+	spin_lock_bh(&dev->lock);
+	if (ktime_before(now, ktime_sub_ns(dev->pace_next, interval / 4))) {
+		dev->stats.paced++;
+		ok = false;
+	} else {
+		/* a stalled producer doesn't earn a burst */
+		if (ktime_before(dev->pace_next, ktime_sub_ns(now, interval)))
+			dev->pace_next = now;
+		dev->pace_next = ktime_add_ns(dev->pace_next, interval);
+	}
+	spin_unlock_bh(&dev->lock);
+	return ok;
+}
+
+/* hands a queued output buffer to the readers */
+static void v4l2l_publish(struct v4l2_loopback_device *dev,
+			  struct v4l2l_buffer *b)
+{
+	set_done(b);
+	if (!v4l2l_pace(dev)) {
+		/* straight back to the producer, on the next DQBUF */
+		spin_lock_bh(&dev->list_lock);
+		list_move_tail(&b->list_head, &dev->outbufs_list);
+		spin_unlock_bh(&dev->list_lock);
+		return;
+	}
+	buffer_written(dev, b);
+	trace_v4l2loopback_qbuf(dev->vdev->num, &b->buffer, 0);
+	wake_up_all(&dev->read_event);
+}
+
+/* moves the metadata the writer set for its next frame to buffer b */
+static void v4l2l_attach_meta(struct v4l2_loopback_device *dev,
+			      struct v4l2_loopback_opener *opener,
+			      struct v4l2l_buffer *b)
+{
+	spin_lock_bh(&dev->lock);
+	b->meta.size = opener->meta.size;
+	memcpy(b->meta.data, opener->meta.data, opener->meta.size);
+	opener->meta.size = 0;
+	spin_unlock_bh(&dev->lock);
+}
+
+/* called on V4L2LOOPBACK_SET_META */
+static long v4l2l_set_meta(struct file *file, void *fh,
+			   struct v4l2_loopback_meta *arg)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+
+	if (opener->type == READER)
+		return -EINVAL;
+	if (arg->size > sizeof(arg->data))
+		return -EINVAL;
+
+	spin_lock_bh(&dev->lock);
+	opener->meta.size = arg->size;
+	memcpy(opener->meta.data, arg->data, arg->size);
+	spin_unlock_bh(&dev->lock);
+	return 0;
+}
+
+/* called on V4L2LOOPBACK_GET_META */
+static long v4l2l_get_meta(struct file *file, void *fh,
+			   struct v4l2_loopback_meta *arg)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+
+	if (opener->type == WRITER)
+		return -EINVAL;
+
+	spin_lock_bh(&dev->lock);
+	arg->size = opener->meta.size;
+	arg->sequence = opener->meta.sequence;
+	memcpy(arg->data, opener->meta.data, opener->meta.size);
+	spin_unlock_bh(&dev->lock);
+	memset(arg->data + arg->size, 0, sizeof(arg->data) - arg->size);
+	return 0;
+}
+
+#ifdef V4L2LOOPBACK_WITH_FENCES
+static void v4l2l_fence_work(struct work_struct *work)
+{
+	struct v4l2l_fence *f = container_of(work, struct v4l2l_fence, work);
+	struct v4l2_loopback_device *dev = f->dev;
+	struct v4l2l_buffer *b = &dev->buffers[f->index];
+	struct dma_fence *fence = f->pending;
+
+	if (dma_fence_get_status(fence) < 0)
+		b->buffer.flags |= V4L2_BUF_FLAG_ERROR;
+	dprintkrw("in-fence of buffer#%d signalled (%d)\n", f->index,
+		  dma_fence_get_status(fence));
+	v4l2l_publish(dev, b);
+	/* only now may VIDIOC_DQBUF hand the buffer back to the producer */
+	WRITE_ONCE(f->pending, NULL);
+	dma_fence_put(fence);
+	wake_up_all(&dev->read_event);
+}
+
+/* may be called in interrupt context */
+static void v4l2l_fence_cb(struct dma_fence *fence, struct dma_fence_cb *cb)
+{
+	struct v4l2l_fence *f = container_of(cb, struct v4l2l_fence, cb);
+	schedule_work(&f->work);
+}
+
+static bool v4l2l_fence_pending(struct v4l2_loopback_device *dev, int index)
+{
+	return READ_ONCE(dev->fences[index].pending) != NULL;
+}
+
+/* defers publishing a queued output buffer until its in-fence signals
+ * returns false if the buffer has no in-fence */
+static bool v4l2l_queue_fenced(struct v4l2_loopback_device *dev,
+			       struct v4l2l_buffer *b)
+{
+	struct v4l2l_fence *f = &dev->fences[b->buffer.index];
+	struct dma_fence *fence;
+
+	spin_lock_bh(&dev->lock);
+	fence = f->next;
+	f->next = NULL;
+	spin_unlock_bh(&dev->lock);
+	if (!fence)
+		return false;
+
+	f->pending = fence;
+	if (dma_fence_add_callback(fence, &f->cb, v4l2l_fence_cb))
+		/* already signalled */
+		schedule_work(&f->work);
+	return true;
+}
+
+static long v4l2l_set_in_fence(struct file *file, void *fh,
+			       struct v4l2_loopback_buffer_fence *arg)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2l_fence *f;
+	struct dma_fence *fence, *old;
+
+	if (opener->type == READER)
+		return -EINVAL;
+	if (arg->index >= dev->used_buffers)
+		return -EINVAL;
+	fence = sync_file_get_fence(arg->fence_fd);
+	if (!fence)
+		return -EINVAL;
+
+	f = &dev->fences[arg->index];
+	spin_lock_bh(&dev->lock);
+	old = f->next;
+	f->next = fence;
+	spin_unlock_bh(&dev->lock);
+	if (old)
+		dma_fence_put(old);
+	return 0;
+}
+
+static void v4l2l_init_fences(struct v4l2_loopback_device *dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_BUFFERS; ++i) {
+		struct v4l2l_fence *f = &dev->fences[i];
+
+		f->dev = dev;
+		f->index = i;
+		INIT_WORK(&f->work, v4l2l_fence_work);
+	}
+}
+
+static void v4l2l_free_fences(struct v4l2_loopback_device *dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_BUFFERS; ++i) {
+		struct v4l2l_fence *f = &dev->fences[i];
+
+		if (f->pending)
+			dma_fence_remove_callback(f->pending, &f->cb);
+		cancel_work_sync(&f->work);
+		if (f->pending)
+			dma_fence_put(f->pending);
+		if (f->next)
+			dma_fence_put(f->next);
+		f->pending = f->next = NULL;
+	}
+}
+#endif /* V4L2LOOPBACK_WITH_FENCES */
+
+static long v4l2l_get_shared_buffer(struct file *file, void *fh,
+				    struct v4l2_loopback_shared_buffer *arg)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2l_buffer *buf;
+	int ret;
+
+	/* the host writes the frame, so only the producer may ask for it */
+	if (video_devdata(file)->vfl_dir == VFL_DIR_RX)
+		return -EINVAL;
+	if (opener->type == READER || opener->timeout_image_io)
+		return -EINVAL;
+	if (arg->index >= dev->used_buffers)
+		return -EINVAL;
+
+	mutex_lock(&dev->image_mutex);
+	buf = &dev->buffers[arg->index];
+	ret = v4l2l_get_frame(dev, buf, dev->buffer_size);
+	if (ret == 0 && buf->shared.vaddr == NULL)
+		ret = -ENODEV;
+	if (ret == 0) {
+		/* the host holds on to the block now */
+		buf->keep = 1;
+		arg->offset = buf->shared.offset;
+		arg->size = buf->size;
+	}
+	mutex_unlock(&dev->image_mutex);
+	return ret;
+}
+
+static long vidioc_default(struct file *file, void *fh, bool valid_prio,
+			   unsigned int cmd, void *arg)
+{
+	switch (cmd) {
+#ifdef V4L2LOOPBACK_WITH_FENCES
+	case V4L2LOOPBACK_SET_IN_FENCE:
+		return v4l2l_set_in_fence(file, fh, arg);
+#endif
+	case V4L2LOOPBACK_SET_SOURCE:
+		return v4l2l_set_source(file, fh, arg);
+	case V4L2LOOPBACK_GET_SHARED_BUFFER:
+		return v4l2l_get_shared_buffer(file, fh, arg);
+	case V4L2LOOPBACK_SET_META:
+		return v4l2l_set_meta(file, fh, arg);
+	case V4L2LOOPBACK_GET_META:
+		return v4l2l_get_meta(file, fh, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* USERPTR frames are copied in on QBUF and out on DQBUF, in the context of
+ * the process that owns the memory, so its pages need not be pinned */
+
+/* copies the frame of an OUTPUT USERPTR buffer into buffer b */
+static int v4l2l_qbuf_userptr(struct v4l2_loopback_device *dev,
+			      struct v4l2_loopback_opener *opener,
+			      struct v4l2l_buffer *b,
+			      const struct v4l2_buffer *buf)
+{
+	size_t count = min3((size_t)b->buffer.bytesused, (size_t)buf->length,
+			    (size_t)dev->buffer_size);
+	int err;
+
+	if (!buf->m.userptr)
+		return -EINVAL;
+#ifdef V4L2LOOPBACK_WITH_FENCES
+	/* the frame is copied right away, not once the fence signals */
+	if (READ_ONCE(dev->fences[b->buffer.index].next))
+		return -EINVAL;
+#endif
+
+	if (mutex_lock_interruptible(&dev->image_mutex))
+		return -ERESTARTSYS;
+	err = v4l2l_get_frame(dev, b,
+			      v4l2l_is_compressed(dev) ? count :
+							 dev->buffer_size);
+	if (!err && copy_from_user(b->data, (const void __user *)buf->m.userptr,
+				   count))
+		err = -EFAULT;
+	mutex_unlock(&dev->image_mutex);
+	if (err < 0)
+		return err;
+
+	b->buffer.bytesused = count;
+	opener->userptr[b->buffer.index].userptr = buf->m.userptr;
+	opener->userptr[b->buffer.index].length = buf->length;
+	return 0;
+}
+
+/* queues a CAPTURE USERPTR buffer for the next frame */
+static int v4l2l_queue_userptr(struct v4l2_loopback_device *dev,
+			       struct v4l2_loopback_opener *opener,
+			       const struct v4l2_buffer *buf)
+{
+	size_t size = opener->conv ? opener->conv->pix_format.sizeimage :
+				     dev->pix_format.sizeimage;
+	int ret = 0;
+
+	if (buf->index >= opener->buffers_number || !buf->m.userptr ||
+	    buf->length < size)
+		return -EINVAL;
+
+	spin_lock_bh(&dev->lock);
+	if (opener->userptr_count >= opener->buffers_number) {
+		ret = -EINVAL;
+	} else {
+		opener->userptr[buf->index].userptr = buf->m.userptr;
+		opener->userptr[buf->index].length = buf->length;
+		opener->userptr_queue[(opener->userptr_head +
+				       opener->userptr_count++) %
+				      MAX_BUFFERS] = buf->index;
+	}
+	spin_unlock_bh(&dev->lock);
+	return ret;
+}
+
+/* copies the frame of buffer#index to the oldest queued CAPTURE USERPTR
+ * buffer, and describes that in buf; the buffer is only taken off the queue
+ * once the copy went through, so it can be dequeued again after an error
+ * call with opener->userptr_lock held */
+static int v4l2l_dqbuf_userptr(struct v4l2_loopback_device *dev,
+			       struct v4l2_loopback_opener *opener, int index,
+			       struct v4l2_buffer *buf)
+{
+	struct v4l2l_buffer *b = &dev->buffers[index];
+	const struct v4l2l_userptr *u;
+	struct mutex *lock;
+	unsigned long ret;
+	size_t count;
+	u8 *data;
+	int i;
+
+	spin_lock_bh(&dev->lock);
+	if (opener->userptr_count == 0) {
+		spin_unlock_bh(&dev->lock);
+		return -EINVAL;
+	}
+	i = opener->userptr_queue[opener->userptr_head];
+	spin_unlock_bh(&dev->lock);
+	u = &opener->userptr[i];
+
+	if (opener->conv) {
+		data = v4l2l_conv_frame(dev, opener->conv, index);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		lock = &opener->conv->lock;
+		count = opener->conv->pix_format.sizeimage;
+	} else {
+		if (mutex_lock_interruptible(&dev->image_mutex))
+			return -ERESTARTSYS;
+		lock = &dev->image_mutex;
+		data = b->data;
+		count = b->buffer.bytesused;
+		if (data && count > b->size)
+			count = b->size;
+	}
+	if (count > u->length)
+		count = u->length;
+	/* a frame that was never written reads as all zeros */
+	if (data)
+		ret = copy_to_user((void __user *)u->userptr, data, count);
+	else
+		ret = clear_user((void __user *)u->userptr, count);
+	mutex_unlock(lock);
+	if (ret)
+		return -EFAULT;
+
+	spin_lock_bh(&dev->lock);
+	opener->userptr_head = (opener->userptr_head + 1) % MAX_BUFFERS;
+	opener->userptr_count--;
+	spin_unlock_bh(&dev->lock);
+
+	unset_flags(b);
+	*buf = b->buffer;
+	buf->index = i;
+	buf->memory = V4L2_MEMORY_USERPTR;
+	buf->m.userptr = u->userptr;
+	buf->length = u->length;
+	buf->bytesused = count;
+	buf->flags &= ~V4L2_BUF_FLAG_MAPPED;
+	return 0;
 }
 
 /* put buffer to queue
@@ -1716,6 +3013,8 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 			buf->length, buf->flags, buf->field,
 			(long long)buf->timestamp.tv_sec,
 			(long int)buf->timestamp.tv_usec, buf->sequence);
+		if (opener->memory == V4L2_MEMORY_USERPTR)
+			return v4l2l_queue_userptr(dev, opener, buf);
 		set_queued(b);
 		return 0;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
@@ -1725,6 +3024,12 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 			buf->length, buf->flags, buf->field,
 			(long long)buf->timestamp.tv_sec,
 			(long int)buf->timestamp.tv_usec, buf->sequence);
+#ifdef V4L2LOOPBACK_WITH_FENCES
+		/* still waiting for the in-fence of the last QBUF */
+		if (v4l2l_fence_pending(dev, index))
+			return -EBUSY;
+#endif
+		b->buffer.flags &= ~V4L2_BUF_FLAG_ERROR;
 		if ((!(b->buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_COPY)) &&
 		    (buf->timestamp.tv_sec == 0 && buf->timestamp.tv_usec == 0))
 			v4l2l_get_timestamp(&b->buffer);
@@ -1750,16 +3055,25 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 		} else {
 			b->buffer.bytesused = buf->bytesused;
 		}
+		if (opener->memory == V4L2_MEMORY_USERPTR) {
+			int err = v4l2l_qbuf_userptr(dev, opener, b, buf);
 
-		set_done(b);
-		buffer_written(dev, b);
+			if (err < 0)
+				return err;
+		}
 
 		/*  Hopefully fix 'DQBUF return bad index if queue bigger then 2 for capture'
                     https://github.com/umlaeute/v4l2loopback/issues/60 */
 		buf->flags &= ~V4L2_BUF_FLAG_DONE;
 		buf->flags |= V4L2_BUF_FLAG_QUEUED;
 
-		wake_up_all(&dev->read_event);
+		v4l2l_attach_meta(dev, opener, b);
+#ifdef V4L2LOOPBACK_WITH_FENCES
+		/* published by v4l2l_fence_work() */
+		if (v4l2l_queue_fenced(dev, b))
+			return 0;
+#endif
+		v4l2l_publish(dev, b);
 		return 0;
 	default:
 		return -EINVAL;
@@ -1779,6 +3093,58 @@ static int can_read(struct v4l2_loopback_device *dev,
 	return ret;
 }
 
+static void v4l2l_stats_read(struct v4l2l_stats *st, s64 dropped,
+			     int repeated, int timeout, s64 latency)
+{
+	st->read++;
+	st->dropped += dropped;
+	if (repeated)
+		st->repeated++;
+	if (timeout)
+		st->timeouts++;
+	if (repeated || timeout)
+		return;
+	st->latency_frames++;
+	st->latency_total += latency;
+	if ((u64)latency > st->latency_max)
+		st->latency_max = latency;
+}
+
+/* accounts for buffer#index being handed to opener, whose metadata goes
+ * along */
+static void v4l2l_count_read(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener, int index,
+			     s64 dropped, int repeated, int timeout)
+{
+	s64 latency = 0;
+
+	if (!repeated && !timeout)
+		latency = max_t(s64, 0,
+				ktime_us_delta(ktime_get(),
+					       dev->buffers[index].written));
+
+	spin_lock_bh(&dev->lock);
+	v4l2l_stats_read(&dev->stats, dropped, repeated, timeout, latency);
+	v4l2l_stats_read(&opener->stats, dropped, repeated, timeout, latency);
+	opener->latency = latency;
+	/* along with the frame, for V4L2LOOPBACK_GET_META */
+	if (timeout) {
+		opener->meta.size = 0;
+	} else {
+		const struct v4l2_loopback_meta *meta =
+			&dev->buffers[index].meta;
+
+		opener->meta.size = meta->size;
+		memcpy(opener->meta.data, meta->data, meta->size);
+	}
+	opener->meta.sequence = dev->buffers[index].buffer.sequence;
+	spin_unlock_bh(&dev->lock);
+
+	if (dropped)
+		trace_v4l2loopback_drop(dev->vdev->num, opener->read_position,
+					dropped);
+}
+
 static int get_capture_buffer(struct file *file)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
@@ -1787,6 +3153,8 @@ static int get_capture_buffer(struct file *file)
 	unsigned int pos;
 	unsigned long long num;
 	int timeout_happened;
+	int repeated = 0;
+	s64 dropped = 0;
 
 	if ((file->f_flags & O_NONBLOCK) &&
 	    (dev->write_position <= opener->read_position &&
@@ -1802,11 +3170,15 @@ static int get_capture_buffer(struct file *file)
 		++opener->reread_count;
 		num = opener->read_position + dev->used_buffers - 1,
 		pos = do_div(num, dev->used_buffers);
+		repeated = 1;
 	} else {
 		opener->reread_count = 0;
 		if (dev->write_position >
-		    opener->read_position + dev->used_buffers)
+		    opener->read_position + dev->used_buffers) {
+			dropped = dev->write_position - 1 -
+				  opener->read_position;
 			opener->read_position = dev->write_position - 1;
+		}
 		num = opener->read_position;
 		pos = do_div(num, dev->used_buffers);
 		++opener->read_position;
@@ -1817,6 +3189,8 @@ static int get_capture_buffer(struct file *file)
 
 	ret = dev->bufpos2index[pos];
 	if (timeout_happened) {
+		int err;
+
 		if (ret < 0) {
 			dprintk("trying to return not mapped buf[%d]\n", ret);
 			return -EFAULT;
@@ -1824,9 +3198,20 @@ static int get_capture_buffer(struct file *file)
 		/* although allocated on-demand, timeout_image is freed only
 		 * in free_buffers(), so we don't need to worry about it being
 		 * deallocated suddenly */
-		memcpy(dev->image + dev->buffers[ret].buffer.m.offset,
-		       dev->timeout_image, dev->buffer_size);
+		mutex_lock(&dev->image_mutex);
+		err = v4l2l_get_frame(dev, &dev->buffers[ret],
+				      dev->buffer_size);
+		if (!err) {
+			memcpy(dev->buffers[ret].data, dev->timeout_image,
+			       dev->buffer_size);
+			dev->buffers[ret].stamp++;
+		}
+		mutex_unlock(&dev->image_mutex);
+		if (err < 0)
+			return err;
 	}
+	v4l2l_count_read(dev, opener, ret, dropped, repeated,
+			 timeout_happened);
 	return ret;
 }
 
@@ -1849,6 +3234,31 @@ static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 
 	switch (buf->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+		if (opener->memory == V4L2_MEMORY_USERPTR) {
+			int ret;
+
+			/* nobody else may take the queued buffer while we
+			 * wait for the frame */
+			if (mutex_lock_interruptible(&opener->userptr_lock))
+				return -ERESTARTSYS;
+			/* there would be nowhere to put the frame */
+			ret = -EINVAL;
+			if (READ_ONCE(opener->userptr_count))
+				ret = get_capture_buffer(file);
+			if (ret >= 0) {
+				index = ret;
+				dprintkrw("capture DQBUF pos: %lld index: %d\n",
+					  (long long)(opener->read_position - 1),
+					  index);
+				ret = v4l2l_dqbuf_userptr(dev, opener, index,
+							  buf);
+			}
+			mutex_unlock(&opener->userptr_lock);
+			if (ret == 0)
+				trace_v4l2loopback_dqbuf(dev->vdev->num, buf,
+							 opener->latency);
+			return ret;
+		}
 		index = get_capture_buffer(file);
 		if (index < 0)
 			return index;
@@ -1859,8 +3269,22 @@ static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 			dprintk("trying to return not mapped buf[%d]\n", index);
 			return -EINVAL;
 		}
+		if (opener->conv) {
+			u8 *data;
+
+			data = v4l2l_conv_frame(dev, opener->conv, index);
+			if (IS_ERR(data))
+				return PTR_ERR(data);
+			mutex_unlock(&opener->conv->lock);
+		}
 		unset_flags(&dev->buffers[index]);
 		*buf = dev->buffers[index].buffer;
+		if (opener->conv) {
+			buf->bytesused = opener->conv->pix_format.sizeimage;
+			buf->length = opener->conv->buffer_size;
+			buf->m.offset = index * opener->conv->buffer_size;
+		}
+		trace_v4l2loopback_dqbuf(dev->vdev->num, buf, opener->latency);
 		dprintkrw(
 			"dqbuf(CAPTURE)#%d: buffer#%d @ %p type=%d bytesused=%d length=%d flags=%x field=%d timestamp=%lld.%06ld sequence=%d\n",
 			index, buf->index, buf, buf->type, buf->bytesused,
@@ -1876,10 +3300,26 @@ static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 		list_move_tail(&b->list_head, &dev->outbufs_list);
 
 		spin_unlock_bh(&dev->list_lock);
+#ifdef V4L2LOOPBACK_WITH_FENCES
+		/* the producer may only reuse the buffer once its in-fence has
+		 * signalled */
+		if (wait_event_interruptible(
+			    dev->read_event,
+			    !v4l2l_fence_pending(dev, b->buffer.index)))
+			return -ERESTARTSYS;
+#endif
 		dprintkrw("output DQBUF index: %d\n", b->buffer.index);
 		unset_flags(b);
 		*buf = b->buffer;
 		buf->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		if (opener->memory == V4L2_MEMORY_USERPTR) {
+			const struct v4l2l_userptr *u =
+				&opener->userptr[b->buffer.index];
+
+			buf->memory = V4L2_MEMORY_USERPTR;
+			buf->m.userptr = u->userptr;
+			buf->length = u->length;
+		}
 		dprintkrw(
 			"dqbuf(OUTPUT)#%d: buffer#%d @ %p type=%d bytesused=%d length=%d flags=%x field=%d timestamp=%lld.%06ld sequence=%d\n",
 			index, buf->index, buf, buf->type, buf->bytesused,
@@ -1914,6 +3354,7 @@ static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
 				return ret;
 		}
 		opener->type = WRITER;
+		WRITE_ONCE(dev->writer_node, numa_node_id());
 		dev->ready_for_output = 0;
 		dev->ready_for_capture++;
 		return 0;
@@ -1924,7 +3365,7 @@ static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
 			return -EBUSY;
 		opener->type = READER;
 		dev->active_readers++;
-		client_usage_queue_event(dev->vdev);
+		client_usage_queue_events(dev);
 		return 0;
 	default:
 		return -EINVAL;
@@ -1955,7 +3396,7 @@ static int vidioc_streamoff(struct file *file, void *fh,
 		if (opener->type == READER) {
 			opener->type = 0;
 			dev->active_readers--;
-			client_usage_queue_event(dev->vdev);
+			client_usage_queue_events(dev);
 		}
 		return 0;
 	default:
@@ -1979,6 +3420,15 @@ static int vidiocgmbuf(struct file *file, void *fh, struct video_mbuf *p)
 }
 #endif
 
+/* the producer of split devices subscribes on the OUTPUT node, while the
+ * readers come and go on the CAPTURE node */
+static void client_usage_queue_events(struct v4l2_loopback_device *dev)
+{
+	client_usage_queue_event(dev->vdev);
+	if (dev->vdev_cap)
+		client_usage_queue_event(dev->vdev_cap);
+}
+
 static void client_usage_queue_event(struct video_device *vdev)
 {
 	struct v4l2_event ev;
@@ -1994,6 +3444,42 @@ static void client_usage_queue_event(struct video_device *vdev)
 	v4l2_event_queue(vdev, &ev);
 }
 
+/* tells subscribers that frame sequence has been published, so that event
+ * loops need not poll every device for frames */
+static void frame_sync_queue_events(struct v4l2_loopback_device *dev,
+				    u32 sequence)
+{
+	struct v4l2_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_FRAME_SYNC;
+	ev.u.frame_sync.frame_sequence = sequence;
+
+	v4l2_event_queue(dev->vdev, &ev);
+	if (dev->vdev_cap)
+		v4l2_event_queue(dev->vdev_cap, &ev);
+}
+
+/* tells subscribers that the frames have changed size or format */
+static void source_change_queue_events(struct v4l2_loopback_device *dev,
+				       const struct v4l2_pix_format *old)
+{
+	struct v4l2_event ev;
+
+	if (old->width == dev->pix_format.width &&
+	    old->height == dev->pix_format.height &&
+	    old->pixelformat == dev->pix_format.pixelformat)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_SOURCE_CHANGE;
+	ev.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+
+	v4l2_event_queue(dev->vdev, &ev);
+	if (dev->vdev_cap)
+		v4l2_event_queue(dev->vdev_cap, &ev);
+}
+
 static int client_usage_ops_add(struct v4l2_subscribed_event *sev,
 				unsigned elems)
 {
@@ -2032,6 +3518,11 @@ static int vidioc_subscribe_event(struct v4l2_fh *fh,
 		return v4l2_ctrl_subscribe_event(fh, sub);
 	case V4L2_EVENT_PRI_CLIENT_USAGE:
 		return v4l2_event_subscribe(fh, sub, 0, &client_usage_ops);
+	case V4L2_EVENT_FRAME_SYNC:
+		/* only the latest frame is of interest */
+		return v4l2_event_subscribe(fh, sub, 1, NULL);
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(fh, sub);
 	}
 
 	return -EINVAL;
@@ -2066,23 +3557,56 @@ static struct vm_operations_struct vm_ops = {
 	.close = vm_close,
 };
 
+/* maps num pages of the page array into vma, starting at vm_start */
+static int v4l2l_insert_pages(struct vm_area_struct *vma,
+			      struct page **pages, unsigned long num)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	unsigned long start = vma->vm_start;
+
+	while (num > 0) {
+		unsigned long left = num;
+		int err = vm_insert_pages(vma, start, pages, &left);
+		if (err < 0)
+			return err;
+		/* vm_insert_pages() might stop early; continue where it left */
+		start += (num - left) << PAGE_SHIFT;
+		pages += num - left;
+		num = left;
+	}
+#else
+	unsigned long start = vma->vm_start;
+	unsigned long i;
+
+	for (i = 0; i < num; i++, start += PAGE_SIZE) {
+		int err = vm_insert_page(vma, start, pages[i]);
+		if (err < 0)
+			return err;
+	}
+#endif
+	return 0;
+}
+
 static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	u8 *addr;
-	unsigned long start;
+	struct page **pages;
 	unsigned long size;
 	struct v4l2_loopback_device *dev;
 	struct v4l2_loopback_opener *opener;
 	struct v4l2l_buffer *buffer = NULL;
+	struct v4l2l_conv *conv;
+	unsigned long buffer_size;
+	int err;
 	MARK();
 
-	start = (unsigned long)vma->vm_start;
 	size = (unsigned long)(vma->vm_end - vma->vm_start);
 
 	dev = v4l2loopback_getdevice(file);
 	opener = fh_to_opener(file->private_data);
+	conv = opener->timeout_image_io ? NULL : opener->conv;
+	buffer_size = conv ? conv->buffer_size : dev->buffer_size;
 
-	if (size > dev->buffer_size) {
+	if (size > buffer_size) {
 		dprintk("userspace tries to mmap too much, fail\n");
 		return -EINVAL;
 	}
@@ -2094,46 +3618,49 @@ static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 			return -EINVAL;
 		}
 	} else if ((vma->vm_pgoff << PAGE_SHIFT) >
-		   dev->buffer_size * (dev->buffers_number - 1)) {
+		   buffer_size * (dev->buffers_number - 1)) {
 		dprintk("userspace tries to mmap too far, fail\n");
 		return -EINVAL;
 	}
 
-	/* FIXXXXXME: allocation should not happen here! */
-	if (NULL == dev->image)
-		if (allocate_buffers(dev) < 0)
-			return -EINVAL;
+	/* buffers are allocated on VIDIOC_S_FMT/VIDIOC_REQBUFS */
+	if (!dev->imagesize) {
+		dprintk("buffers not allocated, call VIDIOC_REQBUFS first\n");
+		return -EINVAL;
+	}
 
 	if (opener->timeout_image_io) {
+		if (NULL == dev->timeout_image_pages)
+			return -EINVAL;
 		buffer = &dev->timeout_image_buffer;
-		addr = dev->timeout_image;
+		pages = dev->timeout_image_pages;
 	} else {
 		int i;
 		for (i = 0; i < dev->buffers_number; ++i) {
 			buffer = &dev->buffers[i];
-			if ((buffer->buffer.m.offset >> PAGE_SHIFT) ==
-			    vma->vm_pgoff)
+			if (((i * buffer_size) >> PAGE_SHIFT) == vma->vm_pgoff)
 				break;
 		}
 
 		if (i >= dev->buffers_number)
 			return -EINVAL;
 
-		addr = dev->image + (vma->vm_pgoff << PAGE_SHIFT);
+		/* frames are allocated on VIDIOC_REQBUFS */
+		pages = conv ? conv->frames[i].pages : buffer->pages;
+		if (NULL == pages && (conv || NULL == buffer->shared.vaddr))
+			return -EINVAL;
 	}
 
-	while (size > 0) {
-		struct page *page;
-
-		page = vmalloc_to_page(addr);
-
-		if (vm_insert_page(vma, start, page) < 0)
-			return -EAGAIN;
-
-		start += PAGE_SIZE;
-		addr += PAGE_SIZE;
-		size -= PAGE_SIZE;
-	}
+	/* host memory has no struct pages to insert */
+	if (NULL == pages)
+		err = remap_pfn_range(vma, vma->vm_start,
+				      buffer->shared.phys_addr >> PAGE_SHIFT,
+				      PAGE_ALIGN(size), vma->vm_page_prot);
+	else
+		err = v4l2l_insert_pages(vma, pages,
+					 PAGE_ALIGN(size) >> PAGE_SHIFT);
+	if (err < 0)
+		return -EAGAIN;
 
 	vma->vm_ops = &vm_ops;
 	vma->vm_private_data = buffer;
@@ -2203,6 +3730,7 @@ static int v4l2_loopback_open(struct file *file)
 	opener = kzalloc(sizeof(*opener), GFP_KERNEL);
 	if (opener == NULL)
 		return -ENOMEM;
+	mutex_init(&opener->userptr_lock);
 
 	atomic_inc(&dev->open_count);
 
@@ -2223,8 +3751,13 @@ static int v4l2_loopback_open(struct file *file)
 	v4l2_fh_init(&opener->fh, video_devdata(file));
 	file->private_data = &opener->fh;
 
+	spin_lock_bh(&dev->lock);
+	list_add_tail(&opener->list, &dev->openers);
+	spin_unlock_bh(&dev->lock);
+
 	v4l2_fh_add(&opener->fh);
-	dprintk("opened dev:%p with image:%p\n", dev, dev ? dev->image : NULL);
+	dprintk("opened dev:%p with imagesize:%ld\n", dev,
+		dev ? dev->imagesize : 0);
 	MARK();
 	return 0;
 }
@@ -2239,6 +3772,8 @@ static int v4l2_loopback_close(struct file *file)
 	opener = fh_to_opener(file->private_data);
 	dev = v4l2loopback_getdevice(file);
 
+	v4l2l_stop_source(xchg(&opener->source, NULL));
+
 	if (WRITER == opener->type)
 		is_writer = 1;
 	if (READER == opener->type)
@@ -2249,42 +3784,100 @@ static int v4l2_loopback_close(struct file *file)
 		del_timer_sync(&dev->sustain_timer);
 		del_timer_sync(&dev->timeout_timer);
 	}
+	if (opener->conv) {
+		mutex_lock(&dev->image_mutex);
+		v4l2l_put_conv(dev, opener->conv);
+		mutex_unlock(&dev->image_mutex);
+	}
 	try_free_buffers(dev);
 
+	spin_lock_bh(&dev->lock);
+	list_del(&opener->list);
+	spin_unlock_bh(&dev->lock);
+
 	v4l2_fh_del(&opener->fh);
 	v4l2_fh_exit(&opener->fh);
 
+	mutex_destroy(&opener->userptr_lock);
 	kfree(opener);
 	if (is_writer)
 		dev->ready_for_output = 1;
 	if (is_reader) {
 		dev->active_readers--;
-		client_usage_queue_event(dev->vdev);
+		client_usage_queue_events(dev);
 	}
 	MARK();
 	return 0;
 }
 
-static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
-				  size_t count, loff_t *ppos)
+/* picks the next frame for a read() of *count bytes; on success returns
+ * its data (NULL for a frame that reads as all zeros) with *lock held
+ * (dev->image_mutex, or that of the opener's conversion), *count clamped
+ * to the frame */
+static u8 *v4l2l_read_begin(struct file *file, size_t *count,
+			    struct mutex **lock)
 {
-	int read_index;
 	struct v4l2_loopback_device *dev;
+	struct v4l2_loopback_opener *opener;
 	struct v4l2_buffer *b;
-	MARK();
+	int read_index;
+	u8 *data;
 
 	dev = v4l2loopback_getdevice(file);
+	opener = fh_to_opener(file->private_data);
+
+	/* the OUTPUT node of split devices */
+	if (video_devdata(file)->vfl_dir == VFL_DIR_TX)
+		return ERR_PTR(-EINVAL);
 
 	read_index = get_capture_buffer(file);
 	if (read_index < 0)
-		return read_index;
-	if (count > dev->buffer_size)
-		count = dev->buffer_size;
+		return ERR_PTR(read_index);
+	trace_v4l2loopback_read(dev->vdev->num,
+				&dev->buffers[read_index].buffer,
+				opener->latency);
+
+	if (opener->conv) {
+		if (*count > opener->conv->pix_format.sizeimage)
+			*count = opener->conv->pix_format.sizeimage;
+		*lock = &opener->conv->lock;
+		return v4l2l_conv_frame(dev, opener->conv, read_index);
+	}
+
+	if (mutex_lock_interruptible(&dev->image_mutex))
+		return ERR_PTR(-ERESTARTSYS);
+	*lock = &dev->image_mutex;
+
+	if (*count > dev->buffer_size)
+		*count = dev->buffer_size;
 	b = &dev->buffers[read_index].buffer;
-	if (count > b->bytesused)
-		count = b->bytesused;
-	if (copy_to_user((void *)buf, (void *)(dev->image + b->m.offset),
-			 count)) {
+	if (*count > b->bytesused)
+		*count = b->bytesused;
+	data = dev->buffers[read_index].data;
+	if (data && *count > dev->buffers[read_index].size)
+		*count = dev->buffers[read_index].size;
+	/* a frame that was never written (or has been reclaimed) reads as
+	 * all zeros */
+	return data;
+}
+
+static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct mutex *lock;
+	u8 *data;
+	unsigned long ret;
+	MARK();
+
+	data = v4l2l_read_begin(file, &count, &lock);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	if (data)
+		ret = copy_to_user((void *)buf, (void *)data, count);
+	else
+		ret = clear_user((void *)buf, count);
+	mutex_unlock(lock);
+	if (ret) {
 		printk(KERN_ERR
 		       "v4l2-loopback: failed copy_to_user() in read buf\n");
 		return -EFAULT;
@@ -2293,84 +3886,655 @@ static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
 	return count;
 }
 
-static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
-				   size_t count, loff_t *ppos)
+/* prepares the next ring slot for a write() of *count bytes; on success
+ * returns the slot index with dev->image_mutex held and the slot's frame
+ * allocated, *count clamped to the buffer size */
+static int v4l2l_write_begin(struct file *file, size_t *count)
 {
 	struct v4l2_loopback_opener *opener;
 	struct v4l2_loopback_device *dev;
 	unsigned int write_index;
 	unsigned long long temp;
-	struct v4l2_buffer *b;
 	int err = 0;
 
-	MARK();
-
 	dev = v4l2loopback_getdevice(file);
 	opener = fh_to_opener(file->private_data);
 
+	/* the CAPTURE node of split devices */
+	if (video_devdata(file)->vfl_dir == VFL_DIR_RX)
+		return -EINVAL;
+
 	if (UNNEGOTIATED == opener->type) {
 		spin_lock(&dev->lock);
 
-		if (dev->ready_for_output) {
-			err = vidioc_streamon(file, file->private_data,
-					      V4L2_BUF_TYPE_VIDEO_OUTPUT);
+		if (dev->ready_for_output) {
+			err = vidioc_streamon(file, file->private_data,
+					      V4L2_BUF_TYPE_VIDEO_OUTPUT);
+		}
+
+		spin_unlock(&dev->lock);
+
+		if (err < 0)
+			return err;
+	}
+
+	if (WRITER != opener->type)
+		return -EINVAL;
+	WRITE_ONCE(dev->writer_node, numa_node_id());
+
+	if (!dev->ready_for_capture) {
+		int ret = allocate_buffers(dev);
+		if (ret < 0)
+			return ret;
+		dev->ready_for_capture = 1;
+	}
+	dprintkrw("v4l2_loopback_write() trying to write %zu bytes\n", *count);
+	if (*count > dev->buffer_size)
+		*count = dev->buffer_size;
+
+	temp = dev->write_position;
+	write_index = do_div(temp, dev->used_buffers);
+
+	if (mutex_lock_interruptible(&dev->image_mutex))
+		return -ERESTARTSYS;
+	/* compressed frames only take the memory they need */
+	err = v4l2l_get_frame(dev, &dev->buffers[write_index],
+			      v4l2l_is_compressed(dev) ? *count :
+							 dev->buffer_size);
+	if (err < 0) {
+		mutex_unlock(&dev->image_mutex);
+		return err;
+	}
+	v4l2l_attach_meta(dev, opener, &dev->buffers[write_index]);
+	/* conversions running meanwhile must not take it for the old frame */
+	dev->buffers[write_index].stamp++;
+	return write_index;
+}
+
+/* drops dev->image_mutex and queues the slot filled with count bytes */
+static void v4l2l_write_end(struct v4l2_loopback_device *dev, int write_index,
+			    size_t count)
+{
+	struct v4l2_buffer *b = &dev->buffers[write_index].buffer;
+
+	mutex_unlock(&dev->image_mutex);
+	v4l2l_get_timestamp(b);
+	b->bytesused = count;
+	b->sequence = dev->write_position;
+	buffer_written(dev, &dev->buffers[write_index]);
+	trace_v4l2loopback_write(dev->vdev->num, b, 0);
+	wake_up_all(&dev->read_event);
+}
+
+static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct v4l2_loopback_device *dev;
+	int write_index;
+
+	MARK();
+
+	dev = v4l2loopback_getdevice(file);
+	/* too early for the nominal frame rate: don't even copy it */
+	if (fh_to_opener(file->private_data)->type == WRITER &&
+	    !v4l2l_pace(dev))
+		return count;
+	write_index = v4l2l_write_begin(file, &count);
+	if (write_index < 0)
+		return write_index;
+
+	if (copy_from_user((void *)dev->buffers[write_index].data, (void *)buf,
+			   count)) {
+		mutex_unlock(&dev->image_mutex);
+		printk(KERN_ERR
+		       "v4l2-loopback: failed copy_from_user() in write buf, could not write %zu\n",
+		       count);
+		return -EFAULT;
+	}
+	v4l2l_write_end(dev, write_index, count);
+	dprintkrw("leave v4l2_loopback_write()\n");
+	return count;
+}
+
+/* reads the next frame from the source straight into the frame memory of
+ * the next ring slot
+ * the slot is only marked busy (rather than holding image_mutex) while
+ * waiting for the frame, so readers are not held up */
+static int v4l2l_source_frame(struct v4l2l_source *src)
+{
+	struct file *file = src->file;
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	size_t count = dev->pix_format.sizeimage;
+	struct v4l2l_buffer *buf;
+	struct iov_iter iter;
+	unsigned int i, num;
+	ssize_t ret = 0;
+	int index;
+
+	index = v4l2l_write_begin(file, &count);
+	if (index < 0)
+		return index;
+	buf = &dev->buffers[index];
+	buf->busy++;
+	mutex_unlock(&dev->image_mutex);
+
+	num = DIV_ROUND_UP(count, PAGE_SIZE);
+	/* host memory has no struct pages to hand to the source (see
+	 * v4l2l_set_source()), host_buffers might have been set since */
+	if (buf->shared.vaddr || buf->pages == NULL) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (num > src->nr_bvec) {
+		kvfree(src->bvec);
+		src->bvec = kvmalloc_array(num, sizeof(*src->bvec), GFP_KERNEL);
+		src->nr_bvec = src->bvec ? num : 0;
+		if (src->bvec == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0; i < num; i++) {
+		src->bvec[i].bv_page = buf->pages[i];
+		src->bvec[i].bv_offset = 0;
+		src->bvec[i].bv_len =
+			min_t(size_t, count - i * PAGE_SIZE, PAGE_SIZE);
+	}
+	iov_iter_bvec(&iter, ITER_DEST, src->bvec, num, count);
+	while (iov_iter_count(&iter)) {
+		ret = vfs_iter_read(src->src, &iter, &src->pos, 0);
+		if (ret == 0)
+			ret = -ENODATA;
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+
+out:
+	mutex_lock(&dev->image_mutex);
+	buf->busy--;
+	if (ret < 0) {
+		mutex_unlock(&dev->image_mutex);
+		return ret;
+	}
+	v4l2l_write_end(dev, index, count);
+	return 0;
+}
+
+static int v4l2l_source_thread(void *data)
+{
+	struct v4l2l_source *src = data;
+	int ret = 0;
+
+	/* so that v4l2l_stop_source() can interrupt a blocking read */
+	allow_signal(SIGKILL);
+	while (ret >= 0 && !kthread_should_stop())
+		ret = v4l2l_source_frame(src);
+	dprintk("source stopped (%d)\n", ret);
+
+	set_current_state(TASK_IDLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_IDLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return ret;
+}
+
+static void v4l2l_stop_source(struct v4l2l_source *src)
+{
+	if (src == NULL)
+		return;
+	send_sig(SIGKILL, src->task, 1);
+	kthread_stop(src->task);
+	fput(src->src);
+	kvfree(src->bvec);
+	kfree(src);
+}
+
+/* called on V4L2LOOPBACK_SET_SOURCE */
+static long v4l2l_set_source(struct file *file, void *fh,
+			     struct v4l2_loopback_source *arg)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2l_source *src;
+	struct task_struct *task;
+	struct file *src_file;
+
+	if (arg->flags)
+		return -EINVAL;
+	v4l2l_stop_source(xchg(&opener->source, NULL));
+	if (arg->fd < 0)
+		return 0;
+
+	/* the CAPTURE node of split devices */
+	if (video_devdata(file)->vfl_dir == VFL_DIR_RX)
+		return -EINVAL;
+	if (opener->type == READER || opener->timeout_image_io)
+		return -EINVAL;
+	/* a byte stream has no frame boundaries for those */
+	if (v4l2l_is_compressed(dev))
+		return -EINVAL;
+	/* frames in host memory have no struct pages, the host fills them
+	 * itself (see V4L2LOOPBACK_GET_SHARED_BUFFER) */
+	if (READ_ONCE(host_buffers))
+		return -EINVAL;
+
+	src_file = fget(arg->fd);
+	if (src_file == NULL)
+		return -EBADF;
+	if (!(src_file->f_mode & FMODE_READ) || !src_file->f_op->read_iter) {
+		fput(src_file);
+		return -EINVAL;
+	}
+	src = kzalloc(sizeof(*src), GFP_KERNEL);
+	if (src == NULL) {
+		fput(src_file);
+		return -ENOMEM;
+	}
+	src->file = file;
+	src->src = src_file;
+
+	task = kthread_run(v4l2l_source_thread, src, "v4l2loopback-%d",
+			   dev->vdev->num);
+	if (IS_ERR(task)) {
+		fput(src_file);
+		kfree(src);
+		return PTR_ERR(task);
+	}
+	src->task = task;
+	if (cmpxchg(&opener->source, NULL, src) != NULL) {
+		/* raced with another V4L2LOOPBACK_SET_SOURCE */
+		v4l2l_stop_source(src);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* init functions */
+/* collects the pages backing a vmalloc()ed area, so mmap() needn't walk
+ * the page tables each time */
+static struct page **v4l2l_vmalloc_page_array(u8 *addr, unsigned long size)
+{
+	unsigned long i, num = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	struct page **pages;
+
+	pages = kvmalloc_array(num, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return NULL;
+	for (i = 0; i < num; i++)
+		pages[i] = vmalloc_to_page(addr + (i << PAGE_SHIFT));
+	return pages;
+}
+
+/* allocates the frame memory of a single buffer, preferably on node
+ * (NUMA_NO_NODE: the local one)
+ * physically contiguous memory is preferred, as it lives in the (huge page
+ * mapped) linear map, so copying frames doesn't thrash the TLB;
+ * frames too large for that (or a fragmented system) fall back to vmalloc() */
+static int v4l2l_alloc_frame(struct v4l2l_buffer *buf, unsigned long size,
+			     int node)
+{
+	unsigned long i, num = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	buf->data = alloc_pages_exact_nid(node, size,
+					  GFP_KERNEL | __GFP_NOWARN |
+						  __GFP_NORETRY);
+	if (buf->data) {
+		buf->pages = kvmalloc_array(num, sizeof(*buf->pages),
+					    GFP_KERNEL);
+		if (buf->pages == NULL) {
+			free_pages_exact(buf->data, size);
+			buf->data = NULL;
+			return -ENOMEM;
+		}
+		for (i = 0; i < num; i++)
+			buf->pages[i] = virt_to_page(buf->data +
+						     (i << PAGE_SHIFT));
+	} else {
+		buf->data = vmalloc_node(size, node);
+		if (buf->data == NULL)
+			return -ENOMEM;
+		buf->pages = v4l2l_vmalloc_page_array(buf->data, size);
+		if (buf->pages == NULL) {
+			vfree(buf->data);
+			buf->data = NULL;
+			return -ENOMEM;
+		}
+	}
+	buf->size = size;
+	return 0;
+}
+
+/* allocates the frame memory of a single buffer from the goldfish address
+ * space, if that driver is loaded
+ * the symbols are looked up at runtime, so that the module still loads on
+ * machines without the device */
+static int v4l2l_alloc_shared_frame(struct v4l2l_buffer *buf,
+				    unsigned long size)
+{
+	int (*alloc_block)(u64, struct goldfish_address_space_block *);
+	int err;
+
+	alloc_block = symbol_get(goldfish_address_space_alloc_block);
+	if (alloc_block == NULL)
+		return -ENODEV;
+	err = alloc_block(size, &buf->shared);
+	if (err < 0) {
+		symbol_put(goldfish_address_space_alloc_block);
+		memset(&buf->shared, 0, sizeof(buf->shared));
+		return err;
+	}
+	buf->data = buf->shared.vaddr;
+	buf->size = size;
+	return 0;
+}
+
+static void v4l2l_free_shared_frame(struct v4l2l_buffer *buf)
+{
+	void (*free_block)(const struct goldfish_address_space_block *);
+
+	/* the module is pinned by the reference taken on allocation */
+	free_block = symbol_get(goldfish_address_space_free_block);
+	if (!WARN_ON(free_block == NULL)) {
+		free_block(&buf->shared);
+		symbol_put(goldfish_address_space_free_block);
+	}
+	symbol_put(goldfish_address_space_alloc_block);
+	memset(&buf->shared, 0, sizeof(buf->shared));
+}
+
+static void v4l2l_free_frame(struct v4l2l_buffer *buf)
+{
+	if (buf->shared.vaddr) {
+		v4l2l_free_shared_frame(buf);
+		buf->data = NULL;
+	} else if (buf->data) {
+		if (is_vmalloc_addr(buf->data))
+			vfree(buf->data);
+		else
+			free_pages_exact(buf->data, buf->size);
+		buf->data = NULL;
+	}
+	kvfree(buf->pages);
+	buf->pages = NULL;
+	buf->size = 0;
+	buf->keep = 0;
+}
+
+/* the NUMA node the frame of buffer#index should go to */
+static int v4l2l_frame_node(struct v4l2_loopback_device *dev, int index)
+{
+	int node = READ_ONCE(dev->frame_node), n, nid;
+
+	if (node == V4L2L_NODE_WRITER)
+		return READ_ONCE(dev->writer_node);
+	if (node != V4L2L_NODE_INTERLEAVE)
+		return node;
+	n = index % num_online_nodes();
+	for_each_online_node(nid)
+		if (n-- == 0)
+			return nid;
+	return NUMA_NO_NODE;
+}
+
+static void v4l2l_schedule_reclaim(struct v4l2_loopback_device *dev)
+{
+	if (reclaim_timeout > 0)
+		schedule_delayed_work(&dev->reclaim_work,
+				      (unsigned long)reclaim_timeout * HZ);
+}
+
+/* makes sure that buf has (at least) size bytes of frame memory; call with
+ * image_mutex held
+ * compressed frames vary in size, so a frame that is too small is grown
+ * (keeping its contents), and one that is much too large is shrunk, unless
+ * it is mmap()ed */
+static int v4l2l_get_frame(struct v4l2_loopback_device *dev,
+			   struct v4l2l_buffer *buf, unsigned long size)
+{
+	struct v4l2l_buffer frame = { 0 };
+	int keep = buf->keep;
+	int err = -ENODEV;
+
+	size = PAGE_ALIGN(max(size, 1UL));
+	if (buf->data && buf->size >= size &&
+	    (buf->keep || buf->use_count > 0 || buf->busy ||
+	     size > buf->size / 2))
+		return 0;
+	if (buf->data && (buf->use_count > 0 || buf->busy))
+		return -EBUSY;
+
+	if (host_buffers)
+		err = v4l2l_alloc_shared_frame(&frame, size);
+	if (err < 0)
+		err = v4l2l_alloc_frame(&frame, size,
+					v4l2l_frame_node(dev, buf - dev->buffers));
+	if (err < 0)
+		return err;
+	if (frame.pages)
+		WRITE_ONCE(dev->last_node, page_to_nid(frame.pages[0]));
+	if (buf->data) {
+		memcpy(frame.data, buf->data,
+		       min3((unsigned long)buf->buffer.bytesused, buf->size,
+			    size));
+		v4l2l_free_frame(buf);
+		buf->keep = keep;
+	}
+	buf->data = frame.data;
+	buf->pages = frame.pages;
+	buf->size = frame.size;
+	buf->shared = frame.shared;
+	buf->last_used = jiffies;
+	v4l2l_schedule_reclaim(dev);
+	return 0;
+}
+
+/* finds the conversion to pix, or sets up a new one; call with image_mutex
+ * held */
+static struct v4l2l_conv *v4l2l_get_conv(struct v4l2_loopback_device *dev,
+					 const struct v4l2_pix_format *pix)
+{
+	struct v4l2l_conv *conv;
+
+	list_for_each_entry(conv, &dev->convs, list) {
+		if (pix_format_eq(&conv->pix_format, pix, 0)) {
+			conv->refcount++;
+			return conv;
+		}
+	}
+
+	conv = kzalloc(sizeof(*conv), GFP_KERNEL);
+	if (conv == NULL)
+		return ERR_PTR(-ENOMEM);
+	conv->refcount = 1;
+	mutex_init(&conv->lock);
+	conv->pix_format = *pix;
+	conv->buffer_size = PAGE_ALIGN(pix->sizeimage);
+	list_add(&conv->list, &dev->convs);
+	return conv;
+}
+
+/* call with image_mutex held */
+static void v4l2l_put_conv(struct v4l2_loopback_device *dev,
+			   struct v4l2l_conv *conv)
+{
+	int i;
+
+	if (--conv->refcount > 0)
+		return;
+	list_del(&conv->list);
+	for (i = 0; i < MAX_BUFFERS; ++i)
+		v4l2l_free_frame(&conv->frames[i]);
+	kvfree(conv->rows);
+	kvfree(conv->sums);
+	mutex_destroy(&conv->lock);
+	kfree(conv);
+}
+
+/* allocates what converting frames of spix takes; call with conv->lock held */
+static int v4l2l_conv_prepare(struct v4l2l_conv *conv, int index,
+			      const struct v4l2_pix_format *spix)
+{
+	int err;
+
+	if (conv->frames[index].data == NULL) {
+		err = v4l2l_alloc_frame(&conv->frames[index], conv->buffer_size,
+					NUMA_NO_NODE);
+		if (err < 0)
+			return err;
+	}
+	if (conv->rows_width < spix->width) {
+		kvfree(conv->rows);
+		conv->rows = kvmalloc_array(3 * spix->width,
+					    sizeof(*conv->rows), GFP_KERNEL);
+		if (conv->rows == NULL) {
+			conv->rows_width = 0;
+			return -ENOMEM;
+		}
+		conv->rows_width = spix->width;
+	}
+	if (conv->sums == NULL && (spix->width != conv->pix_format.width ||
+				   spix->height != conv->pix_format.height)) {
+		conv->sums = kvmalloc_array(3 * conv->pix_format.width,
+					    sizeof(*conv->sums), GFP_KERNEL);
+		if (conv->sums == NULL)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/* makes sure that the converted copy of buffer#index is up to date, and
+ * returns it with conv->lock held (NULL if there is nothing to convert,
+ * which reads as zeros); each written frame is converted at most once per
+ * format, however many readers there are
+ * image_mutex is not held while converting, so the writer is not held up:
+ * the frame is marked busy meanwhile, and if it has been rewritten by the
+ * time the conversion is done, the new one is converted
+ * fails with EPIPE if the writer has switched to a format that cannot be
+ * converted to the reader's (V4L2_EVENT_SOURCE_CHANGE tells it so) */
+static u8 *v4l2l_conv_frame(struct v4l2_loopback_device *dev,
+			    struct v4l2l_conv *conv, int index)
+{
+	struct v4l2l_buffer *src = &dev->buffers[index];
+	struct v4l2l_buffer *dst = &conv->frames[index];
+	struct v4l2_pix_format spix;
+	unsigned int stamp;
+	bool rewritten;
+	int err;
+
+	if (mutex_lock_interruptible(&conv->lock))
+		return ERR_PTR(-ERESTARTSYS);
+	do {
+		if (mutex_lock_interruptible(&dev->image_mutex)) {
+			err = -ERESTARTSYS;
+			goto out_err;
 		}
+		stamp = src->stamp;
+		spix = dev->pix_format;
+		if (src->data == NULL ||
+		    (test_bit(index, conv->valid) &&
+		     conv->stamps[index] == stamp)) {
+			mutex_unlock(&dev->image_mutex);
+			return src->data ? dst->data : NULL;
+		}
+		if (!v4l2l_conv_format(&spix) ||
+		    spix.width < conv->pix_format.width ||
+		    spix.height < conv->pix_format.height) {
+			mutex_unlock(&dev->image_mutex);
+			err = -EPIPE;
+			goto out_err;
+		}
+		src->busy++;
+		mutex_unlock(&dev->image_mutex);
+
+		clear_bit(index, conv->valid);
+		err = v4l2l_conv_prepare(conv, index, &spix);
+		if (!err)
+			v4l2l_convert_frame(&spix, src->data, &conv->pix_format,
+					    dst->data, conv->rows, conv->sums);
+
+		mutex_lock(&dev->image_mutex);
+		src->busy--;
+		rewritten = src->stamp != stamp;
+		mutex_unlock(&dev->image_mutex);
+		if (err)
+			goto out_err;
+	} while (rewritten);
+
+	conv->stamps[index] = stamp;
+	set_bit(index, conv->valid);
+	return dst->data;
+
+out_err:
+	mutex_unlock(&conv->lock);
+	return ERR_PTR(err);
+}
 
-		spin_unlock(&dev->lock);
-
-		if (err < 0)
-			return err;
-	}
+/* gives back the memory of buffers that have not been written for
+ * reclaim_timeout seconds
+ * buffers that are mmap()ed, and the one holding the latest frame, stay */
+static void reclaim_work_clb(struct work_struct *work)
+{
+	struct v4l2_loopback_device *dev = container_of(
+		to_delayed_work(work), struct v4l2_loopback_device,
+		reclaim_work);
+	unsigned long timeout;
+	unsigned long long temp;
+	int i, latest = -1, pending = 0;
 
-	if (WRITER != opener->type)
-		return -EINVAL;
+	if (reclaim_timeout <= 0)
+		return;
+	timeout = (unsigned long)reclaim_timeout * HZ;
 
-	if (!dev->ready_for_capture) {
-		int ret = allocate_buffers(dev);
-		if (ret < 0)
-			return ret;
-		dev->ready_for_capture = 1;
+	mutex_lock(&dev->image_mutex);
+	spin_lock_bh(&dev->lock);
+	if (dev->write_position > 0 && dev->used_buffers > 0) {
+		temp = dev->write_position - 1;
+		latest = dev->bufpos2index[do_div(temp, dev->used_buffers)];
 	}
-	dprintkrw("v4l2_loopback_write() trying to write %zu bytes\n", count);
-	if (count > dev->buffer_size)
-		count = dev->buffer_size;
+	spin_unlock_bh(&dev->lock);
 
-	temp = dev->write_position;
-	write_index = do_div(temp, dev->used_buffers);
-	b = &dev->buffers[write_index].buffer;
+	for (i = 0; i < MAX_BUFFERS; ++i) {
+		struct v4l2l_buffer *buf = &dev->buffers[i];
 
-	if (copy_from_user((void *)(dev->image + b->m.offset), (void *)buf,
-			   count)) {
-		printk(KERN_ERR
-		       "v4l2-loopback: failed copy_from_user() in write buf, could not write %zu\n",
-		       count);
-		return -EFAULT;
+		if (!buf->data || buf->keep || buf->use_count > 0 ||
+		    buf->busy || i == latest)
+			continue;
+		if (time_before(jiffies, buf->last_used + timeout)) {
+			pending = 1;
+			continue;
+		}
+		dprintk("reclaiming buffer#%d of dev:%p\n", i, dev);
+		v4l2l_free_frame(buf);
 	}
-	v4l2l_get_timestamp(b);
-	b->bytesused = count;
-	b->sequence = dev->write_position;
-	buffer_written(dev, &dev->buffers[write_index]);
-	wake_up_all(&dev->read_event);
-	dprintkrw("leave v4l2_loopback_write()\n");
-	return count;
+	mutex_unlock(&dev->image_mutex);
+
+	if (pending)
+		v4l2l_schedule_reclaim(dev);
 }
 
-/* init functions */
 /* frees buffers, if already allocated */
 static void free_buffers(struct v4l2_loopback_device *dev)
 {
+	int i;
+
 	MARK();
-	dprintk("freeing image@%p for dev:%p\n", dev ? dev->image : NULL, dev);
+	dprintk("freeing %ld bytes of buffers for dev:%p\n",
+		dev ? dev->imagesize : 0, dev);
 	if (!dev)
 		return;
-	if (dev->image) {
-		vfree(dev->image);
-		dev->image = NULL;
-	}
+	mutex_lock(&dev->image_mutex);
+	for (i = 0; i < MAX_BUFFERS; ++i)
+		v4l2l_free_frame(&dev->buffers[i]);
+	mutex_unlock(&dev->image_mutex);
 	if (dev->timeout_image) {
 		vfree(dev->timeout_image);
 		dev->timeout_image = NULL;
 	}
+	kvfree(dev->timeout_image_pages);
+	dev->timeout_image_pages = NULL;
 	dev->imagesize = 0;
 }
 /* frees buffers, if they are no longer needed */
@@ -2384,7 +4548,9 @@ static void try_free_buffers(struct v4l2_loopback_device *dev)
 		dev->write_position = 0;
 	}
 }
-/* allocates buffers, if buffer_size is set */
+/* allocates buffers, if buffer_size is set
+ * the frame memory itself is only allocated once a buffer is used, see
+ * v4l2l_get_frame() */
 static int allocate_buffers(struct v4l2_loopback_device *dev)
 {
 	int err;
@@ -2398,7 +4564,7 @@ static int allocate_buffers(struct v4l2_loopback_device *dev)
 	if ((__LONG_MAX__ / dev->buffer_size) < dev->buffers_number)
 		return -ENOSPC;
 
-	if (dev->image) {
+	if (dev->imagesize) {
 		dprintk("allocating buffers again: %ld %ld\n",
 			dev->buffer_size * dev->buffers_number, dev->imagesize);
 		/* FIXME: prevent double allocation more intelligently! */
@@ -2425,11 +4591,6 @@ static int allocate_buffers(struct v4l2_loopback_device *dev)
 			goto error;
 	}
 
-	dev->image = vmalloc(dev->imagesize);
-	if (dev->image == NULL)
-		goto error;
-
-	dprintk("vmallocated %ld bytes\n", dev->imagesize);
 	MARK();
 
 	init_buffers(dev);
@@ -2486,12 +4647,29 @@ static int allocate_timeout_image(struct v4l2_loopback_device *dev)
 			dev->timeout_image_io = 0;
 			return -ENOMEM;
 		}
+		dev->timeout_image_pages = v4l2l_vmalloc_page_array(
+			dev->timeout_image, dev->buffer_size);
+		if (dev->timeout_image_pages == NULL) {
+			vfree(dev->timeout_image);
+			dev->timeout_image = NULL;
+			dev->timeout_image_io = 0;
+			return -ENOMEM;
+		}
 	}
 	return 0;
 }
 
-/* fills and register video device */
-static void init_vdev(struct video_device *vdev, int nr)
+/* fills and register video device
+ * vfl_dir is VFL_DIR_M2M for a device that does both OUTPUT and CAPTURE,
+ * or the direction of one node of split devices */
+/* frees a node along with its private data, once the last opener is gone */
+static void v4l2loopback_vdev_release(struct video_device *vdev)
+{
+	kfree(video_get_drvdata(vdev));
+	video_device_release(vdev);
+}
+
+static void init_vdev(struct video_device *vdev, int nr, int vfl_dir)
 {
 	MARK();
 
@@ -2502,19 +4680,22 @@ static void init_vdev(struct video_device *vdev, int nr)
 	vdev->vfl_type = VFL_TYPE_VIDEO;
 	vdev->fops = &v4l2_loopback_fops;
 	vdev->ioctl_ops = &v4l2_loopback_ioctl_ops;
-	vdev->release = &video_device_release;
+	vdev->release = &v4l2loopback_vdev_release;
 	vdev->minor = -1;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
-	vdev->device_caps = V4L2_CAP_DEVICE_CAPS | V4L2_CAP_VIDEO_CAPTURE |
-			    V4L2_CAP_VIDEO_OUTPUT | V4L2_CAP_READWRITE |
+	vdev->device_caps = V4L2_CAP_DEVICE_CAPS | V4L2_CAP_READWRITE |
 			    V4L2_CAP_STREAMING;
+	if (vfl_dir != VFL_DIR_TX)
+		vdev->device_caps |= V4L2_CAP_VIDEO_CAPTURE;
+	if (vfl_dir != VFL_DIR_RX)
+		vdev->device_caps |= V4L2_CAP_VIDEO_OUTPUT;
 #endif
 
 	if (debug > 1)
 		vdev->dev_debug = V4L2_DEV_DEBUG_IOCTL |
 				  V4L2_DEV_DEBUG_IOCTL_ARG;
 
-	vdev->vfl_dir = VFL_DIR_M2M;
+	vdev->vfl_dir = vfl_dir;
 
 	MARK();
 }
@@ -2555,6 +4736,7 @@ static void sustain_timer_clb(unsigned long nr)
 	spin_lock(&dev->lock);
 	if (dev->sustain_framerate) {
 		dev->reread_count++;
+		dev->stats.sustained++;
 		dprintkrw("reread: %lld %d\n", (long long)dev->write_position,
 			  dev->reread_count);
 		if (dev->reread_count == 1)
@@ -2593,7 +4775,10 @@ static void timeout_timer_clb(unsigned long nr)
 							 (conf->confmember)) : \
 		 default_value)
 
-static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
+/* capture_nr is only honoured with split (see V4L2LOOPBACK_CTL_ADD_SPLIT),
+ * older clients leave it zeroed */
+static int v4l2_loopback_add(struct v4l2_loopback_config *conf, bool split,
+			     int *ret_nr)
 {
 	struct v4l2_loopback_device *dev;
 	struct v4l2_ctrl_handler *hdl;
@@ -2620,16 +4805,14 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	int _max_openers = DEFAULT_FROM_CONF(max_openers, <= 0, max_openers);
 
 	int nr = -1;
+	int split_nr = -1; /* CAPTURE node of split devices */
 
 	_announce_all_caps = (!!_announce_all_caps);
 
 	if (conf) {
 		const int output_nr = conf->output_nr;
-#ifdef SPLIT_DEVICES
-		const int capture_nr = conf->capture_nr;
-#else
-		const int capture_nr = output_nr;
-#endif
+		const int capture_nr = split ? conf->capture_nr : output_nr;
+
 		if (capture_nr >= 0 && output_nr == capture_nr) {
 			nr = output_nr;
 		} else if (capture_nr < 0 && output_nr < 0) {
@@ -2639,32 +4822,30 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 		} else if (output_nr < 0) {
 			nr = capture_nr;
 		} else {
-			printk(KERN_ERR
-			       "split OUTPUT and CAPTURE devices not yet supported.");
-			printk(KERN_INFO
-			       "both devices must have the same number (%d != %d).",
-			       output_nr, capture_nr);
-			return -EINVAL;
+			nr = output_nr;
+			split_nr = capture_nr;
 		}
 	}
 
-	if (idr_find(&v4l2loopback_index_idr, nr))
-		return -EEXIST;
-
-	dprintk("creating v4l2loopback-device #%d\n", nr);
+	dprintk("creating v4l2loopback-device #%d (capture #%d)\n", nr,
+		split_nr);
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
 		return -ENOMEM;
 
-	/* allocate id, if @id >= 0, we're requesting that specific id */
+	/* allocate id, if @id >= 0, we're requesting that specific id
+	 * the id is only reserved for now (the slot stays NULL), so that the
+	 * (slow) device registration can run without holding the mutex */
+	mutex_lock(&v4l2loopback_ctl_mutex);
 	if (nr >= 0) {
-		err = idr_alloc(&v4l2loopback_index_idr, dev, nr, nr + 1,
+		err = idr_alloc(&v4l2loopback_index_idr, NULL, nr, nr + 1,
 				GFP_KERNEL);
 		if (err == -ENOSPC)
 			err = -EEXIST;
 	} else {
-		err = idr_alloc(&v4l2loopback_index_idr, dev, 0, 0, GFP_KERNEL);
+		err = idr_alloc(&v4l2loopback_index_idr, NULL, 0, 0, GFP_KERNEL);
 	}
+	mutex_unlock(&v4l2loopback_ctl_mutex);
 	if (err < 0)
 		goto out_free_dev;
 	nr = err;
@@ -2683,6 +4864,9 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	err = v4l2_device_register(NULL, &dev->v4l2_dev);
 	if (err)
 		goto out_free_idr;
+	/* only called once nodes have been registered, see
+	 * v4l2_loopback_remove() */
+	dev->v4l2_dev.release = v4l2_loopback_release;
 	MARK();
 
 	dev->vdev = video_device_alloc();
@@ -2708,9 +4892,29 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 		 dev->card_label);
 
 	vdev_priv->device_nr = nr;
+	vdev_priv->dev = dev;
 
-	init_vdev(dev->vdev, nr);
+	init_vdev(dev->vdev, nr, (split_nr < 0) ? VFL_DIR_M2M : VFL_DIR_TX);
 	dev->vdev->v4l2_dev = &dev->v4l2_dev;
+
+	if (split_nr >= 0) {
+		struct v4l2loopback_private *cap_priv;
+
+		cap_priv = kzalloc(sizeof(*cap_priv), GFP_KERNEL);
+		dev->vdev_cap = video_device_alloc();
+		if (cap_priv == NULL || dev->vdev_cap == NULL) {
+			kfree(cap_priv);
+			err = -ENOMEM;
+			goto out_unregister;
+		}
+		cap_priv->device_nr = nr;
+		cap_priv->dev = dev;
+		video_set_drvdata(dev->vdev_cap, cap_priv);
+		snprintf(dev->vdev_cap->name, sizeof(dev->vdev_cap->name),
+			 "%s", dev->card_label);
+		init_vdev(dev->vdev_cap, nr, VFL_DIR_RX);
+		dev->vdev_cap->v4l2_dev = &dev->v4l2_dev;
+	}
 	init_capture_param(&dev->capture_param);
 	err = set_timeperframe(dev, &dev->capture_param.timeperframe);
 	if (err)
@@ -2718,7 +4922,9 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev->keep_format = 0;
 	dev->sustain_framerate = 0;
 
-	dev->announce_all_caps = _announce_all_caps;
+	/* each node of split devices has a fixed direction (which the v4l2
+	 * core enforces), so the caps need not follow the ready flags */
+	dev->announce_all_caps = (split_nr >= 0) || _announce_all_caps;
 	dev->min_width = _min_width;
 	dev->min_height = _min_height;
 	dev->max_width = _max_width;
@@ -2727,6 +4933,10 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev->buffers_number = dev->used_buffers = _max_buffers;
 
 	dev->write_position = 0;
+	dev->frame_node = v4l2l_valid_frame_node(frame_node) ? frame_node :
+							      V4L2L_NODE_WRITER;
+	dev->writer_node = NUMA_NO_NODE;
+	dev->last_node = NUMA_NO_NODE;
 
 	MARK();
 	spin_lock_init(&dev->lock);
@@ -2745,8 +4955,14 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev->ready_for_output = 1;
 
 	dev->buffer_size = 0;
-	dev->image = NULL;
 	dev->imagesize = 0;
+	mutex_init(&dev->image_mutex);
+	INIT_LIST_HEAD(&dev->convs);
+	INIT_LIST_HEAD(&dev->openers);
+	INIT_DELAYED_WORK(&dev->reclaim_work, reclaim_work_clb);
+#ifdef V4L2LOOPBACK_WITH_FENCES
+	v4l2l_init_fences(dev);
+#endif
 #ifdef HAVE_TIMER_SETUP
 	timer_setup(&dev->sustain_timer, sustain_timer_clb, 0);
 	timer_setup(&dev->timeout_timer, timeout_timer_clb, 0);
@@ -2757,6 +4973,7 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev->reread_count = 0;
 	dev->timeout_jiffies = 0;
 	dev->timeout_image = NULL;
+	dev->timeout_image_pages = NULL;
 	dev->timeout_happened = 0;
 
 	hdl = &dev->ctrl_handler;
@@ -2812,146 +5029,476 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 		err = -EFAULT;
 		goto out_free_device;
 	}
+	if (dev->vdev_cap &&
+	    video_register_device(dev->vdev_cap, VFL_TYPE_VIDEO, split_nr) <
+		    0) {
+		printk(KERN_ERR
+		       "v4l2loopback: failed video_register_device() for capture\n");
+		err = -EFAULT;
+		goto out_unregister_device;
+	}
+
+	/* publish the device */
+	mutex_lock(&v4l2loopback_ctl_mutex);
+	err = idr_alloc(&v4l2loopback_vdevnr_idr, dev, dev->vdev->num,
+			dev->vdev->num + 1, GFP_KERNEL);
+	if (err >= 0 && dev->vdev_cap) {
+		err = idr_alloc(&v4l2loopback_vdevnr_idr, dev,
+				dev->vdev_cap->num, dev->vdev_cap->num + 1,
+				GFP_KERNEL);
+		if (err < 0)
+			idr_remove(&v4l2loopback_vdevnr_idr, dev->vdev->num);
+	}
+	if (err >= 0)
+		idr_replace(&v4l2loopback_index_idr, dev, nr);
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+	if (err < 0)
+		goto out_unregister_device;
 	v4l2loopback_create_sysfs(dev->vdev);
+	if (dev->vdev_cap)
+		v4l2loopback_create_sysfs(dev->vdev_cap);
+	dev->debugfs = debugfs_create_file(video_device_node_name(dev->vdev),
+					   S_IRUGO, v4l2loopback_debugfs_root,
+					   dev, &v4l2l_debugfs_fops);
 
 	MARK();
 	if (ret_nr)
 		*ret_nr = dev->vdev->num;
 	return 0;
 
+out_unregister_device:
+	if (dev->vdev_cap && !video_is_registered(dev->vdev_cap)) {
+		kfree(video_get_drvdata(dev->vdev_cap));
+		video_device_release(dev->vdev_cap);
+		dev->vdev_cap = NULL;
+	}
+	/* the nodes might have been opened already (udev does), so the
+	 * device goes away with the last opener */
+	v4l2_loopback_remove(dev);
+	mutex_lock(&v4l2loopback_ctl_mutex);
+	idr_remove(&v4l2loopback_index_idr, nr);
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+	return err;
 out_free_device:
 	video_device_release(dev->vdev);
 out_free_handler:
 	v4l2_ctrl_handler_free(&dev->ctrl_handler);
 out_unregister:
+	if (dev->vdev_cap) {
+		kfree(video_get_drvdata(dev->vdev_cap));
+		video_device_release(dev->vdev_cap);
+	}
 	video_set_drvdata(dev->vdev, NULL);
 	if (vdev_priv != NULL)
 		kfree(vdev_priv);
 	v4l2_device_unregister(&dev->v4l2_dev);
 out_free_idr:
+	mutex_lock(&v4l2loopback_ctl_mutex);
 	idr_remove(&v4l2loopback_index_idr, nr);
+	mutex_unlock(&v4l2loopback_ctl_mutex);
 out_free_dev:
 	kfree(dev);
 	return err;
 }
 
-static void v4l2_loopback_remove(struct v4l2_loopback_device *dev)
+/* frees the device, once its nodes are unregistered and every opener has
+ * closed them */
+static void v4l2_loopback_release(struct v4l2_device *v4l2_dev)
 {
+	struct v4l2_loopback_device *dev =
+		container_of(v4l2_dev, struct v4l2_loopback_device, v4l2_dev);
+
+	MARK();
+	cancel_delayed_work_sync(&dev->reclaim_work);
+	del_timer_sync(&dev->sustain_timer);
+	del_timer_sync(&dev->timeout_timer);
+#ifdef V4L2LOOPBACK_WITH_FENCES
+	v4l2l_free_fences(dev);
+#endif
 	free_buffers(dev);
+	v4l2_ctrl_handler_free(&dev->ctrl_handler);
+	kfree(dev);
+}
+
+/* unregisters the nodes of the device
+ * openers can do nothing but close them from now on; the device itself is
+ * freed with the last of them, see v4l2_loopback_release() */
+static void v4l2_loopback_remove(struct v4l2_loopback_device *dev)
+{
+	debugfs_remove(dev->debugfs);
+	if (dev->vdev_cap) {
+		v4l2loopback_remove_sysfs(dev->vdev_cap);
+		video_unregister_device(dev->vdev_cap);
+	}
 	v4l2loopback_remove_sysfs(dev->vdev);
-	kfree(video_get_drvdata(dev->vdev));
 	video_unregister_device(dev->vdev);
 	v4l2_device_unregister(&dev->v4l2_dev);
-	v4l2_ctrl_handler_free(&dev->ctrl_handler);
-	kfree(dev);
+	v4l2_device_put(&dev->v4l2_dev);
 }
 
-static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
-				       unsigned long parm)
+/* fills conf with the settings of dev
+ * capture_nr is left alone, unless split is set */
+static void v4l2loopback_fill_config(struct v4l2_loopback_device *dev,
+				     struct v4l2_loopback_config *conf,
+				     bool split)
+{
+	snprintf(conf->card_label, sizeof(conf->card_label), "%s",
+		 dev->card_label);
+	conf->output_nr = dev->vdev->num;
+	if (split)
+		conf->capture_nr = dev->vdev_cap ? dev->vdev_cap->num :
+						   dev->vdev->num;
+	conf->min_width = dev->min_width;
+	conf->min_height = dev->min_height;
+	conf->max_width = dev->max_width;
+	conf->max_height = dev->max_height;
+	conf->announce_all_caps = dev->announce_all_caps;
+	conf->max_buffers = dev->buffers_number;
+	conf->max_openers = dev->max_openers;
+	conf->debug = debug;
+}
+
+/* get information for a loopback device.
+ * this is mostly about limits (which cannot be queried directly with
+ * VIDIOC_G_FMT and friends)
+ * capture_nr is only looked at with split (see V4L2LOOPBACK_CTL_QUERY_SPLIT)
+ * call with v4l2loopback_ctl_mutex held */
+static int v4l2loopback_query(struct v4l2_loopback_config *conf, bool split)
 {
 	struct v4l2_loopback_device *dev;
-	struct v4l2_loopback_config conf;
-	struct v4l2_loopback_config *confptr = &conf;
 	int device_nr, capture_nr, output_nr;
 	int ret;
 
+	output_nr = conf->output_nr;
+	capture_nr = split ? conf->capture_nr : output_nr;
+	device_nr = (output_nr < 0) ? capture_nr : output_nr;
+	MARK();
+	/* get the device from either capture_nr or output_nr (whatever is valid) */
+	if ((ret = v4l2loopback_lookup(device_nr, &dev)) < 0)
+		return ret;
+	MARK();
+	/* if we got the device from output_nr and there is a valid capture_nr,
+	 * make sure that both refer to the same device (or bail out)
+	 */
+	if ((device_nr != capture_nr) && (capture_nr >= 0) &&
+	    ((ret = v4l2loopback_lookup(capture_nr, 0)) < 0))
+		return ret;
+	MARK();
+	/* if otoh, we got the device from capture_nr and there is a valid output_nr,
+	 * make sure that both refer to the same device (or bail out)
+	 */
+	if ((device_nr != output_nr) && (output_nr >= 0) &&
+	    ((ret = v4l2loopback_lookup(output_nr, 0)) < 0))
+		return ret;
+	MARK();
+
+	/* v4l2_loopback_config identified a single device, so fetch the data */
+	v4l2loopback_fill_config(dev, conf, split);
+	return 0;
+}
+
+/* takes the device out of the lookup tables, so it can be removed
+ * call with v4l2loopback_ctl_mutex held */
+static void v4l2loopback_unpublish(struct v4l2_loopback_device *dev, int nr)
+{
+	idr_remove(&v4l2loopback_index_idr, nr);
+	idr_remove(&v4l2loopback_vdevnr_idr, dev->vdev->num);
+	if (dev->vdev_cap)
+		idr_remove(&v4l2loopback_vdevnr_idr, dev->vdev_cap->num);
+}
+
+/* removes the device with the given device-number, unless it is in use
+ * (with force, it is removed anyway, see v4l2_loopback_remove()) */
+static int v4l2loopback_remove_nr(int device_nr, bool force)
+{
+	struct v4l2_loopback_device *dev = NULL;
+	int ret;
+
 	ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
 	if (ret)
 		return ret;
+	ret = v4l2loopback_lookup(device_nr, &dev);
+	if (ret >= 0 && dev) {
+		int nr = ret;
+		ret = -EBUSY;
+		if (force || dev->open_count.counter == 0) {
+			v4l2loopback_unpublish(dev, nr);
+			ret = 0;
+		}
+	}
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+
+	/* unregister the device outside of the ctl mutex */
+	if (!ret)
+		v4l2_loopback_remove(dev);
+	return ret;
+}
+
+/* copies the array of configurations referred to by vec from userspace */
+static struct v4l2_loopback_config *
+v4l2loopback_get_config_vec(struct v4l2_loopback_config_vec *vec,
+			    unsigned long parm)
+{
+	if (copy_from_user(vec, (void *)parm, sizeof(*vec)))
+		return ERR_PTR(-EFAULT);
+	if ((vec->flags & ~V4L2LOOPBACK_CONFIG_VEC_SPLIT) || !vec->count ||
+	    vec->count > VIDEO_NUM_DEVICES)
+		return ERR_PTR(-EINVAL);
+	return vmemdup_user(u64_to_user_ptr(vec->configs),
+			    array_size(vec->count,
+				       sizeof(struct v4l2_loopback_config)));
+}
+
+/* creates all requested devices, or none */
+static int v4l2loopback_add_vec(unsigned long parm)
+{
+	struct v4l2_loopback_config_vec vec;
+	struct v4l2_loopback_config *confs;
+	unsigned int i;
+	bool split;
+	int ret = 0;
+
+	confs = v4l2loopback_get_config_vec(&vec, parm);
+	if (IS_ERR(confs))
+		return PTR_ERR(confs);
+	split = vec.flags & V4L2LOOPBACK_CONFIG_VEC_SPLIT;
+
+	for (i = 0; i < vec.count; i++) {
+		int device_nr;
+		ret = v4l2_loopback_add(&confs[i], split, &device_nr);
+		if (ret < 0)
+			break;
+		/* report back the numbers the devices actually got */
+		confs[i].output_nr = device_nr;
+		if (split)
+			confs[i].capture_nr = -1;
+		mutex_lock(&v4l2loopback_ctl_mutex);
+		v4l2loopback_query(&confs[i], split);
+		mutex_unlock(&v4l2loopback_ctl_mutex);
+	}
+
+	if (!ret && copy_to_user(u64_to_user_ptr(vec.configs), confs,
+				 array_size(vec.count, sizeof(*confs))))
+		ret = -EFAULT;
+
+	/* roll back, even if udev has opened the new nodes already */
+	if (ret < 0) {
+		while (i-- > 0)
+			v4l2loopback_remove_nr(confs[i].output_nr, true);
+	}
+
+	kvfree(confs);
+	return ret;
+}
+
+/* removes all listed devices, or none (if any of them is missing or busy) */
+static int v4l2loopback_remove_vec(unsigned long parm)
+{
+	struct v4l2_loopback_config_vec vec;
+	struct v4l2_loopback_config *confs;
+	struct v4l2_loopback_device **devs;
+	int *nrs;
+	unsigned int i, j;
+	int ret;
+
+	confs = v4l2loopback_get_config_vec(&vec, parm);
+	if (IS_ERR(confs))
+		return PTR_ERR(confs);
+
+	devs = kcalloc(vec.count, sizeof(*devs), GFP_KERNEL);
+	nrs = kcalloc(vec.count, sizeof(*nrs), GFP_KERNEL);
+	if (!devs || !nrs) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < vec.count; i++) {
+		ret = v4l2loopback_lookup(confs[i].output_nr, &devs[i]);
+		if (ret < 0)
+			break;
+		nrs[i] = ret;
+		ret = -EBUSY;
+		if (devs[i]->open_count.counter > 0)
+			break;
+		/* each device must only be listed once */
+		ret = -EINVAL;
+		for (j = 0; j < i; j++)
+			if (devs[j] == devs[i])
+				break;
+		if (j < i)
+			break;
+		ret = 0;
+	}
+	if (!ret) {
+		for (i = 0; i < vec.count; i++)
+			v4l2loopback_unpublish(devs[i], nrs[i]);
+	}
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+
+	/* unregister the devices outside of the ctl mutex */
+	if (!ret) {
+		for (i = 0; i < vec.count; i++)
+			v4l2_loopback_remove(devs[i]);
+	}
+
+out_free:
+	kfree(nrs);
+	kfree(devs);
+	kvfree(confs);
+	return ret;
+}
+
+/* queries all listed devices in one go */
+static int v4l2loopback_query_vec(unsigned long parm)
+{
+	struct v4l2_loopback_config_vec vec;
+	struct v4l2_loopback_config *confs;
+	unsigned int i;
+	int ret;
+
+	confs = v4l2loopback_get_config_vec(&vec, parm);
+	if (IS_ERR(confs))
+		return PTR_ERR(confs);
+
+	ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
+	if (ret)
+		goto out_free;
+	for (i = 0; i < vec.count; i++) {
+		ret = v4l2loopback_query(
+			&confs[i], vec.flags & V4L2LOOPBACK_CONFIG_VEC_SPLIT);
+		if (ret < 0)
+			break;
+	}
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+
+	if (!ret && copy_to_user(u64_to_user_ptr(vec.configs), confs,
+				 array_size(vec.count, sizeof(*confs))))
+		ret = -EFAULT;
+
+out_free:
+	kvfree(confs);
+	return ret;
+}
+
+/* returns the configuration of all devices */
+static int v4l2loopback_list(unsigned long parm)
+{
+	struct v4l2_loopback_config_vec vec;
+	struct v4l2_loopback_config *confs = NULL;
+	struct v4l2_loopback_device *dev;
+	unsigned int count = 0;
+	int id, ret;
+
+	if (copy_from_user(&vec, (void *)parm, sizeof(vec)))
+		return -EFAULT;
+	if (vec.flags & ~V4L2LOOPBACK_CONFIG_VEC_SPLIT)
+		return -EINVAL;
+	if (vec.count > VIDEO_NUM_DEVICES)
+		vec.count = VIDEO_NUM_DEVICES;
+	if (vec.count) {
+		confs = kvcalloc(vec.count, sizeof(*confs), GFP_KERNEL);
+		if (!confs)
+			return -ENOMEM;
+	}
+
+	ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
+	if (ret)
+		goto out_free;
+	/* devices that are still being set up have an empty slot, and are
+	 * skipped */
+	idr_for_each_entry(&v4l2loopback_index_idr, dev, id) {
+		if (count < vec.count)
+			v4l2loopback_fill_config(
+				dev, &confs[count],
+				vec.flags & V4L2LOOPBACK_CONFIG_VEC_SPLIT);
+		count++;
+	}
+	mutex_unlock(&v4l2loopback_ctl_mutex);
+
+	if (confs && copy_to_user(u64_to_user_ptr(vec.configs), confs,
+				  array_size(min(count, vec.count),
+					     sizeof(*confs)))) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+	/* report the total number of devices, so userspace can retry with a
+	 * larger array */
+	vec.count = count;
+	if (copy_to_user((void *)parm, &vec, sizeof(vec)))
+		ret = -EFAULT;
+
+out_free:
+	kvfree(confs);
+	return ret;
+}
+
+static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
+				       unsigned long parm)
+{
+	struct v4l2_loopback_config conf;
+	struct v4l2_loopback_config *confptr = &conf;
+	bool split;
+	int device_nr;
+	int ret;
 
-	ret = -EINVAL;
+	/* the ctl mutex is not held across video_register_device() or
+	 * video_unregister_device(), all requests take care of the locking
+	 * themselves */
 	switch (cmd) {
 	default:
 		ret = -ENOSYS;
 		break;
 		/* add a v4l2loopback device (pair), based on the user-provided specs */
 	case V4L2LOOPBACK_CTL_ADD:
+	case V4L2LOOPBACK_CTL_ADD_SPLIT:
+		split = (cmd == V4L2LOOPBACK_CTL_ADD_SPLIT);
 		if (parm) {
-			if ((ret = copy_from_user(&conf, (void *)parm,
-						  sizeof(conf))) < 0)
-				break;
+			if (copy_from_user(&conf, (void *)parm, sizeof(conf)))
+				return -EFAULT;
 		} else
 			confptr = NULL;
-		ret = v4l2_loopback_add(confptr, &device_nr);
+		ret = v4l2_loopback_add(confptr, split, &device_nr);
 		if (ret >= 0)
 			ret = device_nr;
 		break;
 		/* remove a v4l2loopback device (both capture and output) */
 	case V4L2LOOPBACK_CTL_REMOVE:
-		ret = v4l2loopback_lookup((int)parm, &dev);
-		if (ret >= 0 && dev) {
-			int nr = ret;
-			ret = -EBUSY;
-			if (dev->open_count.counter > 0)
-				break;
-			idr_remove(&v4l2loopback_index_idr, nr);
-			v4l2_loopback_remove(dev);
-			ret = 0;
-		};
+		ret = v4l2loopback_remove_nr((int)parm, false);
 		break;
-		/* get information for a loopback device.
-                 * this is mostly about limits (which cannot be queried directly with  VIDIOC_G_FMT and friends
-                 */
 	case V4L2LOOPBACK_CTL_QUERY:
+	case V4L2LOOPBACK_CTL_QUERY_SPLIT:
+		split = (cmd == V4L2LOOPBACK_CTL_QUERY_SPLIT);
 		if (!parm)
-			break;
-		if ((ret = copy_from_user(&conf, (void *)parm, sizeof(conf))) <
-		    0)
-			break;
-		capture_nr = output_nr = conf.output_nr;
-#ifdef SPLIT_DEVICES
-		capture_nr = conf.capture_nr;
-#endif
-		device_nr = (output_nr < 0) ? capture_nr : output_nr;
-		MARK();
-		/* get the device from either capture_nr or output_nr (whatever is valid) */
-		if ((ret = v4l2loopback_lookup(device_nr, &dev)) < 0)
-			break;
-		MARK();
-		/* if we got the device from output_nr and there is a valid capture_nr,
-                 * make sure that both refer to the same device (or bail out)
-                 */
-		if ((device_nr != capture_nr) && (capture_nr >= 0) &&
-		    ((ret = v4l2loopback_lookup(capture_nr, 0)) < 0))
-			break;
-		MARK();
-		/* if otoh, we got the device from capture_nr and there is a valid output_nr,
-                 * make sure that both refer to the same device (or bail out)
-                 */
-		if ((device_nr != output_nr) && (output_nr >= 0) &&
-		    ((ret = v4l2loopback_lookup(output_nr, 0)) < 0))
-			break;
-		MARK();
-
-		/* v4l2_loopback_config identified a single device, so fetch the data */
-		snprintf(conf.card_label, sizeof(conf.card_label), "%s",
-			 dev->card_label);
-		MARK();
-		conf.output_nr = dev->vdev->num;
-#ifdef SPLIT_DEVICES
-		conf.capture_nr = dev->vdev->num;
-#endif
-		conf.min_width = dev->min_width;
-		conf.min_height = dev->min_height;
-		conf.max_width = dev->max_width;
-		conf.max_height = dev->max_height;
-		conf.announce_all_caps = dev->announce_all_caps;
-		conf.max_buffers = dev->buffers_number;
-		conf.max_openers = dev->max_openers;
-		conf.debug = debug;
+			return -EINVAL;
+		if (copy_from_user(&conf, (void *)parm, sizeof(conf)))
+			return -EFAULT;
+		ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
+		if (ret)
+			return ret;
+		ret = v4l2loopback_query(&conf, split);
+		mutex_unlock(&v4l2loopback_ctl_mutex);
 		MARK();
-		if (copy_to_user((void *)parm, &conf, sizeof(conf))) {
+		if (!ret && copy_to_user((void *)parm, &conf, sizeof(conf)))
 			ret = -EFAULT;
-			break;
-		}
-		MARK();
-		ret = 0;
-		;
+		break;
+	case V4L2LOOPBACK_CTL_ADD_VEC:
+		ret = v4l2loopback_add_vec(parm);
+		break;
+	case V4L2LOOPBACK_CTL_REMOVE_VEC:
+		ret = v4l2loopback_remove_vec(parm);
+		break;
+	case V4L2LOOPBACK_CTL_QUERY_VEC:
+		ret = v4l2loopback_query_vec(parm);
+		break;
+	case V4L2LOOPBACK_CTL_LIST:
+		ret = v4l2loopback_list(parm);
 		break;
 	}
 
-	MARK();
-	mutex_unlock(&v4l2loopback_ctl_mutex);
 	MARK();
 	return ret;
 }
@@ -2976,6 +5523,10 @@ static struct miscdevice v4l2loopback_misc = {
 	// clang-format on
 };
 
+/* there is no .read_iter/.write_iter, and so no splice() either:
+ * v4l2_file_operations has no such hooks, the v4l2 core owns the
+ * file_operations of the device node, and read()/write() move one whole
+ * frame per call, which splice's page-sized chunks would tear apart */
 static const struct v4l2_file_operations v4l2_loopback_fops = {
 	// clang-format off
 	.owner		= THIS_MODULE,
@@ -3041,19 +5592,23 @@ static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops = {
 
 	.vidioc_subscribe_event		= &vidioc_subscribe_event,
 	.vidioc_unsubscribe_event	= &v4l2_event_unsubscribe,
+
+	.vidioc_default			= &vidioc_default,
 	// clang-format on
 };
 
 static int free_device_cb(int id, void *ptr, void *data)
 {
 	struct v4l2_loopback_device *dev = ptr;
-	v4l2_loopback_remove(dev);
+	if (dev)
+		v4l2_loopback_remove(dev);
 	return 0;
 }
 static void free_devices(void)
 {
 	idr_for_each(&v4l2loopback_index_idr, &free_device_cb, NULL);
 	idr_destroy(&v4l2loopback_index_idr);
+	idr_destroy(&v4l2loopback_vdevnr_idr);
 }
 
 static int __init v4l2loopback_init_module(void)
@@ -3064,9 +5619,13 @@ static int __init v4l2loopback_init_module(void)
 	int i;
 	MARK();
 
+	v4l2loopback_debugfs_root = debugfs_create_dir("v4l2loopback", NULL);
+
 	err = misc_register(&v4l2loopback_misc);
-	if (err < 0)
+	if (err < 0) {
+		debugfs_remove_recursive(v4l2loopback_debugfs_root);
 		return err;
+	}
 
 	if (devices < 0) {
 		devices = 1;
@@ -3080,11 +5639,11 @@ static int __init v4l2loopback_init_module(void)
 		}
 	}
 
-	if (devices > MAX_DEVICES) {
-		devices = MAX_DEVICES;
+	if (devices > VIDEO_NUM_DEVICES) {
+		devices = VIDEO_NUM_DEVICES;
 		printk(KERN_INFO
 		       "v4l2loopback: number of initial devices is limited to: %d\n",
-		       MAX_DEVICES);
+		       VIDEO_NUM_DEVICES);
 	}
 
 	if (max_buffers > MAX_BUFFERS) {
@@ -3113,27 +5672,33 @@ static int __init v4l2loopback_init_module(void)
 	}
 
 	for (i = 0; i < devices; i++) {
+		/* only the first MAX_DEVICES can be configured individually */
+		const int nr = (i < MAX_DEVICES) ? video_nr[i] : -1;
+		const int cap_nr = (i < MAX_DEVICES && capture_video_nr[i] >= 0) ?
+					   capture_video_nr[i] :
+					   nr;
+		const bool excl = (i < MAX_DEVICES) ?
+					  exclusive_caps[i] :
+					  V4L2LOOPBACK_DEFAULT_EXCLUSIVECAPS;
 		struct v4l2_loopback_config cfg = {
 			// clang-format off
-			.output_nr		= video_nr[i],
-#ifdef SPLIT_DEVICES
-			.capture_nr		= video_nr[i],
-#endif
+			.output_nr		= nr,
+			.capture_nr		= cap_nr,
 			.min_width		= min_width,
 			.min_height		= min_height,
 			.max_width		= max_width,
 			.max_height		= max_height,
-			.announce_all_caps	= (!exclusive_caps[i]),
+			.announce_all_caps	= (!excl),
 			.max_buffers		= max_buffers,
 			.max_openers		= max_openers,
 			.debug			= debug,
 			// clang-format on
 		};
 		cfg.card_label[0] = 0;
-		if (card_label[i])
+		if (i < MAX_DEVICES && card_label[i])
 			snprintf(cfg.card_label, sizeof(cfg.card_label), "%s",
 				 card_label[i]);
-		err = v4l2_loopback_add(&cfg, 0);
+		err = v4l2_loopback_add(&cfg, true, 0);
 		if (err) {
 			free_devices();
 			goto error;
@@ -3158,6 +5723,7 @@ static int __init v4l2loopback_init_module(void)
 	return 0;
 error:
 	misc_deregister(&v4l2loopback_misc);
+	debugfs_remove_recursive(v4l2loopback_debugfs_root);
 	return err;
 }
 
@@ -3168,6 +5734,7 @@ static void v4l2loopback_cleanup_module(void)
 	free_devices();
 	/* and get rid of /dev/v4l2loopback */
 	misc_deregister(&v4l2loopback_misc);
+	debugfs_remove_recursive(v4l2loopback_debugfs_root);
 	dprintk("module removed\n");
 }
 
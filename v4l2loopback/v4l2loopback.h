@@ -14,6 +14,10 @@
 #define V4L2LOOPBACK_VERSION_MINOR 12
 #define V4L2LOOPBACK_VERSION_BUGFIX 7
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/videodev2.h>
+
 /* /dev/v4l2loopback interface */
 
 struct v4l2_loopback_config {
@@ -22,18 +26,27 @@ struct v4l2_loopback_config {
          * V4L2LOOPBACK_CTL_ADD:
          * setting this to a value<0, will allocate an available one
          * if nr>=0 and the device already exists, the ioctl will EEXIST
-         * if output_nr and capture_nr are the same, only a single device will be created
-	 * NOTE: currently split-devices (where output_nr and capture_nr differ)
-	 *   are not implemented yet.
-	 *   until then, requesting different device-IDs will result in EINVAL.
+         * a single device is created, that does both OUTPUT and CAPTURE
+         *
+         * V4L2LOOPBACK_CTL_ADD_SPLIT:
+         * as above, if output_nr and capture_nr are the same (or capture_nr<0)
+         * if output_nr and capture_nr are both >=0 and differ, two devices
+         * are created, that share the frames: /dev/video<output_nr> only does
+         * OUTPUT (for the producer), /dev/video<capture_nr> only does CAPTURE
+         * (for the consumers)
          *
-         * V4L2LOOPBACK_CTL_QUERY:
+         * V4L2LOOPBACK_CTL_QUERY_SPLIT:
          * either both output_nr and capture_nr must refer to the same loopback,
          * or one (and only one) of them must be -1
          *
+         * capture_nr used to be reserved (as 'unused'): all other requests
+         * ignore it, and leave it untouched
          */
 	int output_nr;
-	int unused; /*capture_nr;*/
+	union {
+		int unused;
+		int capture_nr;
+	};
 
 	/**
          * a nice name for your device
@@ -71,8 +84,7 @@ struct v4l2_loopback_config {
          * whether to announce OUTPUT/CAPTURE capabilities exclusively
          * for this device or not
          * (!exclusive_caps)
-	 * NOTE: this is going to be removed once separate output/capture
-	 *       devices are implemented
+         * NOTE: split devices always announce only their own capabilities
          */
 	int announce_all_caps;
 };
@@ -86,13 +98,171 @@ struct v4l2_loopback_config {
  */
 #define V4L2LOOPBACK_CTL_ADD 0x4C80
 
+/* as V4L2LOOPBACK_CTL_ADD, but honours capture_nr (split devices) */
+#define V4L2LOOPBACK_CTL_ADD_SPLIT 0x4C87
+
+/* a pointer to a (struct v4l2_loopback_config) that has output_nr set
+ */
+#define V4L2LOOPBACK_CTL_QUERY 0x4C82
+
 /* a pointer to a (struct v4l2_loopback_config) that has output_nr and/or capture_nr set
  * (the two values must either refer to video-devices associated with the same loopback device
  *  or exactly one of them must be <0
+ * on return, capture_nr is the CAPTURE device (which is output_nr, unless the
+ * device is split)
  */
-#define V4L2LOOPBACK_CTL_QUERY 0x4C82
+#define V4L2LOOPBACK_CTL_QUERY_SPLIT 0x4C88
 
 /* the device-number (either CAPTURE or OUTPUT) associated with the loopback-device */
 #define V4L2LOOPBACK_CTL_REMOVE 0x4C81
 
+/* an array of (struct v4l2_loopback_config), for the batch requests below */
+struct v4l2_loopback_config_vec {
+	/**
+         * number of elements in the array
+         * V4L2LOOPBACK_CTL_LIST:
+         * the capacity of the array; on return, the total number of
+         * devices (which might be larger than the capacity)
+         */
+	__u32 count;
+	/**
+         * 0, or V4L2LOOPBACK_CONFIG_VEC_SPLIT: the elements are used as with
+         * V4L2LOOPBACK_CTL_ADD_SPLIT and V4L2LOOPBACK_CTL_QUERY_SPLIT
+         * (rather than V4L2LOOPBACK_CTL_ADD and V4L2LOOPBACK_CTL_QUERY)
+         */
+	__u32 flags;
+	/**
+         * pointer to the array of (struct v4l2_loopback_config)
+         */
+	__u64 configs;
+};
+
+#define V4L2LOOPBACK_CONFIG_VEC_SPLIT 0x0001
+
+/* a pointer to a (struct v4l2_loopback_config_vec), each element is used as
+ * with V4L2LOOPBACK_CTL_ADD.
+ * either all devices are created, or none.
+ * on success, the output_nr of each element is set to the device_nr of the
+ * newly created OUTPUT device
+ */
+#define V4L2LOOPBACK_CTL_ADD_VEC 0x4C83
+
+/* a pointer to a (struct v4l2_loopback_config_vec), the output_nr of each
+ * element is the device-number of a device to remove.
+ * either all devices are removed, or none (if any of them does not exist or
+ * is still in use)
+ */
+#define V4L2LOOPBACK_CTL_REMOVE_VEC 0x4C84
+
+/* a pointer to a (struct v4l2_loopback_config_vec), each element is used as
+ * with V4L2LOOPBACK_CTL_QUERY
+ */
+#define V4L2LOOPBACK_CTL_QUERY_VEC 0x4C85
+
+/* a pointer to a (struct v4l2_loopback_config_vec), that is filled with the
+ * configuration of all loopback devices (up to 'count')
+ */
+#define V4L2LOOPBACK_CTL_LIST 0x4C86
+
+/* /dev/video* interface */
+
+/* explicit synchronization of a single buffer */
+struct v4l2_loopback_buffer_fence {
+	/**
+         * the index of the buffer (as with VIDIOC_QBUF/VIDIOC_DQBUF)
+         */
+	__u32 index;
+	/**
+         * a sync_file fd, the frame in the buffer is complete once it
+         * signals
+         */
+	__s32 fence_fd;
+	__u32 reserved[2];
+};
+
+/* on the OUTPUT side, before VIDIOC_QBUF of the buffer:
+ * VIDIOC_QBUF returns right away, but the frame is only handed to readers
+ * once the fence has signalled (with V4L2_BUF_FLAG_ERROR, if the fence
+ * failed); VIDIOC_DQBUF of the buffer waits for the fence
+ */
+#define V4L2LOOPBACK_SET_IN_FENCE                  \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 0, \
+	     struct v4l2_loopback_buffer_fence)
+
+/* BASE_VIDIOC_PRIVATE + 1 is reserved
+ * readers need no fence: a frame is only handed to them (VIDIOC_DQBUF,
+ * read()) once its in-fence has signalled
+ */
+
+/* an in-kernel producer, feeding the device from a file */
+struct v4l2_loopback_source {
+	/**
+         * a readable fd (e.g. a connected goldfish pipe) that delivers
+         * whole frames of the format set on the OUTPUT side, back to back
+         * <0 to stop the source
+         */
+	__s32 fd;
+	__u32 flags; /* must be 0 */
+	__u32 reserved[2];
+};
+
+/* on the OUTPUT side: the device reads frames from the fd by itself (as if
+ * they were write()n), until the fd reports EOF or an error, the source is
+ * stopped, or the opener closes the device
+ * files that take kernel pages for reading (like goldfish pipes) fill the
+ * frame buffers directly, without any copy in the guest
+ * fails with EINVAL with host_buffers=1: the host fills such frames itself
+ * (see V4L2LOOPBACK_GET_SHARED_BUFFER)
+ */
+#define V4L2LOOPBACK_SET_SOURCE                  \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 2, \
+	     struct v4l2_loopback_source)
+
+/* a frame buffer in memory shared with the host */
+struct v4l2_loopback_shared_buffer {
+	__u32 index; /* set by the caller */
+	__u32 reserved0;
+	__u64 offset; /* into the goldfish address space */
+	__u64 size;
+	__u32 reserved[2];
+};
+
+/* with host_buffers=1: where the frame of a buffer lives in the goldfish
+ * address space, so the host can write it in place
+ * the guest publishes the frame with VIDIOC_QBUF on the OUTPUT side, as
+ * usual
+ * only for the producer, fails with EINVAL on the CAPTURE side
+ * fails with ENODEV if the frame is in guest memory
+ */
+#define V4L2LOOPBACK_GET_SHARED_BUFFER           \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 3, \
+	      struct v4l2_loopback_shared_buffer)
+
+/* the most metadata that can go along with a frame */
+#define V4L2LOOPBACK_META_MAX 256
+
+/* opaque per-frame metadata (crop, exposure, HDR, ...), in whatever layout
+ * producer and consumers agree on */
+struct v4l2_loopback_meta {
+	__u32 size; /* bytes used of data */
+	__u32 sequence; /* V4L2LOOPBACK_GET_META: the frame's sequence */
+	__u32 reserved[2];
+	__u8 data[V4L2LOOPBACK_META_MAX];
+};
+
+/* on the OUTPUT side: metadata for the next frame that is queued (or
+ * written); frames queued without it carry none
+ */
+#define V4L2LOOPBACK_SET_META                    \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 4, \
+	     struct v4l2_loopback_meta)
+
+/* on the CAPTURE side: the metadata of the frame last handed out by
+ * VIDIOC_DQBUF (or read()); it is taken along with the frame, so it
+ * always matches the frame even if the writer has moved on
+ */
+#define V4L2LOOPBACK_GET_META                    \
+	_IOR('V', BASE_VIDIOC_PRIVATE + 5, \
+	     struct v4l2_loopback_meta)
+
 #endif /* _V4L2LOOPBACK_H */
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * v4l2loopback_trace.h  --  tracepoints of the video4linux2 loopback driver
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM v4l2loopback
+
+#if !defined(_V4L2LOOPBACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _V4L2LOOPBACK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/videodev2.h>
+
+/* a frame passing through the ring
+ * latency is the time (in us) since the frame was written, for frames
+ * handed to readers; 0 on the writer side and for repeated frames */
+DECLARE_EVENT_CLASS(v4l2loopback_frame,
+	TP_PROTO(int device, const struct v4l2_buffer *b, s64 latency),
+	TP_ARGS(device, b, latency),
+
+	TP_STRUCT__entry(
+		__field(int, device)
+		__field(u32, index)
+		__field(u32, sequence)
+		__field(u32, bytesused)
+		__field(s64, timestamp)
+		__field(s64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->device = device;
+		__entry->index = b->index;
+		__entry->sequence = b->sequence;
+		__entry->bytesused = b->bytesused;
+		__entry->timestamp = (s64)b->timestamp.tv_sec * USEC_PER_SEC +
+				     b->timestamp.tv_usec;
+		__entry->latency = latency;
+	),
+
+	TP_printk("video%d index=%u sequence=%u bytesused=%u timestamp=%lld latency=%lldus",
+		  __entry->device, __entry->index, __entry->sequence,
+		  __entry->bytesused, __entry->timestamp, __entry->latency)
+);
+
+DEFINE_EVENT(v4l2loopback_frame, v4l2loopback_qbuf,
+	TP_PROTO(int device, const struct v4l2_buffer *b, s64 latency),
+	TP_ARGS(device, b, latency)
+);
+
+DEFINE_EVENT(v4l2loopback_frame, v4l2loopback_write,
+	TP_PROTO(int device, const struct v4l2_buffer *b, s64 latency),
+	TP_ARGS(device, b, latency)
+);
+
+DEFINE_EVENT(v4l2loopback_frame, v4l2loopback_dqbuf,
+	TP_PROTO(int device, const struct v4l2_buffer *b, s64 latency),
+	TP_ARGS(device, b, latency)
+);
+
+DEFINE_EVENT(v4l2loopback_frame, v4l2loopback_read,
+	TP_PROTO(int device, const struct v4l2_buffer *b, s64 latency),
+	TP_ARGS(device, b, latency)
+);
+
+/* a reader fell behind by more than the ring, and skipped frames */
+TRACE_EVENT(v4l2loopback_drop,
+	TP_PROTO(int device, s64 read_position, s64 dropped),
+	TP_ARGS(device, read_position, dropped),
+
+	TP_STRUCT__entry(
+		__field(int, device)
+		__field(s64, read_position)
+		__field(s64, dropped)
+	),
+
+	TP_fast_assign(
+		__entry->device = device;
+		__entry->read_position = read_position;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("video%d read_position=%lld dropped=%lld", __entry->device,
+		  __entry->read_position, __entry->dropped)
+);
+
+#endif /* _V4L2LOOPBACK_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE v4l2loopback_trace
+#include <trace/define_trace.h>